@@ -0,0 +1,74 @@
+// Throughput of event_merger for a growing number of shards. Every shard pushes drains of
+// synthetic events stamped with increasing timestamps, interleaved with the other shards, and
+// the merger releases them in global order. Build from this directory with
+//   g++ -std=c++17 -O2 -I.. merge.cpp -o merge -lpthread
+// Usage: merge [events], spread evenly over the shards of each run
+
+#include "watch_merge.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+namespace
+{
+    constexpr size_t DrainEvents = 64; // events pushed by one shard per drain
+
+    // Pushes events of every shard round-robin, one drain at a time, and takes whatever the
+    // merger releases. Returns the number of events taken.
+    size_t Run(size_t shards, size_t perShard, const std::string& path)
+    {
+        watch::event_merger merger(shards, 4 * DrainEvents);
+        std::vector<uint64_t> sequences(shards);
+        size_t taken = 0;
+        int64_t timestamp = 0;
+        watch::stamped_event out;
+
+        for(size_t done = 0; done < perShard; done += DrainEvents)
+        {
+            for(uint32_t shard = 0; shard < shards; shard++)
+            {
+                timestamp++;
+                for(size_t i = 0; i < DrainEvents; i++)
+                {
+                    watch::stamped_event event;
+                    event.Sequence = ++sequences[shard];
+                    event.Timestamp = timestamp;
+                    event.Path = &path;
+                    event.Event.Type = watch::directory_event::file_modified;
+                    while(!merger.Push(shard, event))
+                    {
+                        if(merger.Next(out))
+                            taken++;
+                    }
+                }
+                merger.Advance(shard, timestamp);
+                while(merger.Next(out))
+                    taken++;
+            }
+        }
+        for(uint32_t shard = 0; shard < shards; shard++)
+            merger.Close(shard);
+        while(merger.Next(out))
+            taken++;
+        return taken;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    size_t events = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 8000000;
+    std::string path = "/bench";
+
+    std::printf("%8s %12s %12s %14s\n", "shards", "events", "ms", "events/s");
+    for(size_t shards : {1, 2, 4, 8, 16, 64})
+    {
+        auto start = std::chrono::steady_clock::now();
+        size_t taken = Run(shards, events / shards, path);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::printf("%8zu %12zu %12.1f %14.0f\n", shards, taken, seconds * 1000, taken / seconds);
+    }
+    return 0;
+}
@@ -0,0 +1,81 @@
+// Diff throughput of two synthetic directory snapshots, by default at 1M and 10M entries,
+// on one thread and on every hardware thread. The second snapshot modifies, deletes and
+// adds one entry in a hundred each. Build from this directory with
+//   g++ -std=c++17 -O2 -I.. snapshot_diff.cpp -o snapshot_diff -lpthread
+// Usage: snapshot_diff [entries...]
+
+#include "watch_snapshot.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+namespace
+{
+    std::string Name(size_t i)
+    {
+        char name[32];
+        std::snprintf(name, sizeof(name), "file%010zu", i);
+        return name;
+    }
+
+    void Build(size_t entries, watch::directory_snapshot& before, watch::directory_snapshot& after)
+    {
+        for(size_t i = 0; i < entries; i++)
+        {
+            watch::file_info info;
+            info.Size = i;
+            info.ModifiedNs = 1000000000;
+            info.Inode = i + 1;
+            before.Add(Name(i), info);
+
+            switch(i % 100)
+            {
+            case 0: // deleted
+                break;
+            case 1: // modified
+                info.Size++;
+                after.Add(Name(i), info);
+                break;
+            case 2: // kept, and a new name sorting right after it
+                after.Add(Name(i), info);
+                after.Add(Name(i) + "-new", info);
+                break;
+            default:
+                after.Add(Name(i), info);
+            }
+        }
+        before.Sort();
+        after.Sort();
+    }
+}
+
+int main(int argc, char** argv)
+{
+    std::vector<size_t> sizes;
+    for(int i = 1; i < argc; i++)
+        sizes.push_back(std::strtoull(argv[i], nullptr, 10));
+    if(sizes.empty())
+        sizes = {1000000, 10000000};
+
+    unsigned hardware = std::max(1u, std::thread::hardware_concurrency());
+    std::printf("%12s %8s %10s %12s %14s\n", "entries", "threads", "events", "ms", "entries/s");
+    for(size_t entries : sizes)
+    {
+        watch::directory_snapshot before, after;
+        Build(entries, before, after);
+        for(unsigned threads : {1u, hardware})
+        {
+            auto start = std::chrono::steady_clock::now();
+            auto events = watch::Diff(before, after, threads);
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            std::printf("%12zu %8u %10zu %12.1f %14.0f\n", entries, threads, events.size(), seconds * 1000,
+                        (before.Size() + after.Size()) / seconds);
+            if(threads == hardware)
+                break;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,100 @@
+// Rewrites the same files over many dispatches, in a different order each time so their
+// interned ids get recycled and swapped, and checks that every event of a file lands on the
+// lane LaneOf names for it. Build from this directory with
+//   g++ -std=c++17 -O2 -I.. lane_routing.cpp -o lane_routing -lpthread
+// Exits with 1 if any check failed.
+
+#include "watch_lanes.h"
+
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+extern "C"
+{
+#include "fcntl.h"
+#include "stdlib.h"
+#include "unistd.h"
+}
+
+namespace
+{
+    int failures = 0;
+
+    void Check(bool condition, const std::string& what)
+    {
+        if(!condition)
+        {
+            std::printf("FAILED: %s\n", what.c_str());
+            failures++;
+        }
+    }
+
+    void Write(const std::string& path, int round)
+    {
+        int fd = open(path.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644);
+        std::string contents = std::to_string(round);
+        if(fd == -1 || write(fd, contents.data(), contents.size()) != (ssize_t)contents.size())
+            std::perror(path.c_str());
+        close(fd);
+    }
+
+    std::string MakeRoot()
+    {
+        char name[] = "/tmp/lane_routing.XXXXXX";
+        return mkdtemp(name) == nullptr ? std::string() : std::string(name);
+    }
+}
+
+int main()
+{
+    std::string root = MakeRoot();
+    if(root.empty())
+    {
+        std::perror("mkdtemp");
+        return 1;
+    }
+
+    std::mutex mutex;
+    std::map<std::string, std::set<unsigned>> seen;
+    watch::lane_options options;
+    options.Lanes = 16;
+    watch::lane_dispatcher dispatcher([&](unsigned lane, const std::string&, const watch::directory_event& event)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        seen[event.Name].insert(lane);
+    }, options);
+    dispatcher.Watch(root);
+
+    const std::vector<std::string> names{"a", "b", "c", "d", "e", "f", "g", "h"};
+    const int rounds = 32;
+    for(int round = 0; round < rounds; round++)
+    {
+        for(size_t i = 0; i < names.size(); i++)
+            Write(root + "/" + names[(i + round) % names.size()], round);
+        dispatcher.Dispatch();
+        dispatcher.Flush();
+    }
+
+    for(auto& name : names)
+    {
+        auto iter = seen.find(name);
+        Check(iter != seen.end(), name + " was dispatched");
+        if(iter == seen.end())
+            continue;
+        Check(iter->second.size() == 1, name + " stays on one lane");
+        Check(*iter->second.begin() == dispatcher.LaneOf(root, name), name + " lands on LaneOf");
+    }
+
+    std::string cleanup = "rm -rf " + root;
+    if(std::system(cleanup.c_str()) != 0)
+        std::printf("could not remove %s\n", root.c_str());
+
+    if(failures != 0)
+        return 1;
+    std::printf("all checks passed\n");
+    return 0;
+}
@@ -0,0 +1,120 @@
+// Seeds two directory trees, watches both with merkle_tree_watch and checks Differences after
+// edits on either side. Build from this directory with
+//   g++ -std=c++17 -O2 -I.. merkle_differences.cpp -o merkle_differences -lpthread
+// Exits with 1 if any check failed.
+
+#include "watch_merkle.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+extern "C"
+{
+#include "fcntl.h"
+#include "stdlib.h"
+#include "sys/stat.h"
+#include "unistd.h"
+}
+
+namespace
+{
+    int failures = 0;
+
+    void Check(bool condition, const char* what)
+    {
+        if(!condition)
+        {
+            std::printf("FAILED: %s\n", what);
+            failures++;
+        }
+    }
+
+    // Writes contents with a fixed modification time, so equal files on both sides hash equal.
+    void Write(const std::string& path, const std::string& contents)
+    {
+        int fd = open(path.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644);
+        if(fd == -1 || write(fd, contents.data(), contents.size()) != (ssize_t)contents.size())
+            std::perror(path.c_str());
+        struct timespec times[2] = {{1000000000, 0}, {1000000000, 0}};
+        futimens(fd, times);
+        close(fd);
+    }
+
+    void Seed(const std::string& root)
+    {
+        mkdir((root + "/dir").c_str(), 0755);
+        mkdir((root + "/dir/sub").c_str(), 0755);
+        Write(root + "/a", "alpha");
+        Write(root + "/dir/b", "bravo");
+        Write(root + "/dir/sub/c", "charlie");
+    }
+
+    std::vector<std::string> Sorted(std::vector<std::string> paths)
+    {
+        std::sort(paths.begin(), paths.end());
+        return paths;
+    }
+
+    std::string MakeRoot()
+    {
+        char name[] = "/tmp/merkle_differences.XXXXXX";
+        return mkdtemp(name) == nullptr ? std::string() : std::string(name);
+    }
+}
+
+int main()
+{
+    std::string left = MakeRoot(), right = MakeRoot();
+    if(left.empty() || right.empty())
+    {
+        std::perror("mkdtemp");
+        return 1;
+    }
+    Seed(left);
+    Seed(right);
+
+    watch::merkle_tree_watch leftTree(left, 2), rightTree(right, 2);
+    Check(leftTree.Digest() == rightTree.Digest(), "seeded trees have equal digests");
+    Check(watch::merkle_tree_watch::Differences(leftTree, rightTree).empty(), "seeded trees have no differences");
+
+    // a changed file, a directory only on the left, a file only on the right
+    Write(left + "/dir/b", "bravo, changed");
+    mkdir((left + "/extra").c_str(), 0755);
+    Write(left + "/extra/d", "delta");
+    unlink((right + "/a").c_str());
+    leftTree.Refresh();
+    rightTree.Refresh();
+
+    std::vector<std::string> expected{"a", "dir/b", "extra"};
+    Check(Sorted(watch::merkle_tree_watch::Differences(leftTree, rightTree)) == expected,
+          "differences are a, dir/b and extra");
+    Check(leftTree.Digest(left + "/dir/sub") == rightTree.Digest(right + "/dir/sub"), "untouched subtree keeps its digest");
+
+    // a deeper change shows up under its full relative path
+    Write(right + "/dir/sub/c", "charlie, changed");
+    rightTree.Refresh();
+    expected = {"a", "dir/b", "dir/sub/c", "extra"};
+    Check(Sorted(watch::merkle_tree_watch::Differences(leftTree, rightTree)) == expected,
+          "differences include dir/sub/c");
+
+    // making the right side match again brings the digests back together
+    Write(right + "/a", "alpha");
+    Write(right + "/dir/b", "bravo, changed");
+    Write(right + "/dir/sub/c", "charlie");
+    mkdir((right + "/extra").c_str(), 0755);
+    Write(right + "/extra/d", "delta");
+    rightTree.Refresh();
+    Check(watch::merkle_tree_watch::Differences(leftTree, rightTree).empty(), "matching trees have no differences");
+    Check(leftTree.Digest() == rightTree.Digest(), "matching trees have equal digests");
+
+    std::string cleanup = "rm -rf " + left + " " + right;
+    if(std::system(cleanup.c_str()) != 0)
+        std::printf("could not remove %s and %s\n", left.c_str(), right.c_str());
+
+    if(failures != 0)
+        return 1;
+    std::printf("all checks passed\n");
+    return 0;
+}
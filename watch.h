@@ -1,13 +1,39 @@
 #pragma once
 
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
+#include <set>
+#include <string>
+#include <string_view>
+#include <memory_resource>
+#include <memory>
+#include <atomic>
+#include <new>
+#include <utility>
+#include <chrono>
+#include <functional>
+#include <shared_mutex>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <deque>
 #include <climits>
+#include <cstdint>
+#include <cstdlib>
+#include <cerrno>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
 
 extern "C"
 {
 #include "sys/inotify.h"
 #include "unistd.h"
+#include "sys/mman.h"
+#include "sys/stat.h"
+#include "fcntl.h"
+#include "poll.h"
 }
 
 //#define WATCH_DEBUG 0
@@ -19,9 +45,27 @@ extern "C"
 #define LOG(...)
 #endif
 
+//#define WATCH_PROFILE 1
+
+#ifdef WATCH_PROFILE
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#define PROFILE(stage) watch_impl::profile_scope profileScope(watch::profile_stage::stage);
+#else
+#define PROFILE(stage)
+#endif
+
 
 namespace watch
 {
+    // How much a subscriber has to look at again after an events_overflowed marker.
+    enum class rescan_scope : uint8_t
+    {
+        directory, // the entries of the watched directory
+        subtree    // the directory and everything below it, it went unwatched for a while
+    };
+    
     struct directory_event
     {
         enum type
@@ -29,22 +73,138 @@ namespace watch
             watch_directory_destroyed, // the watched directory was destroyed
             file_created,
             file_deleted,
-            file_modified
+            file_modified,
+            events_overflowed, // events were lost at this point, the subscriber has to rescan Scope
+            file_replaced      // the file was atomically replaced, e.g. a temporary file renamed over it
         };
     
         type Type;
         std::string Name;
+        // Interned id of Name in the pool that produced the event, 0 for no name. Ids are recycled,
+        // one only stays bound to Name while the event is queued, see inotify_watch_pool::Names.
+        uint32_t NameId;
+        
+        // Only meaningful for events_overflowed. Every loss, like a kernel queue overflow or a
+        // budget overflow, gets the pool's next generation; a kernel overflow marks every watch
+        // with the same one, so a subscriber of many directories can rescan once per generation.
+        rescan_scope Scope;
+        uint64_t Generation;
     
         directory_event() :
             Type(watch_directory_destroyed),
-            Name({})
+            Name({}),
+            NameId(0),
+            Scope(rescan_scope::directory),
+            Generation(0)
         {}
         
         directory_event(type type, const std::string& name) :
                 Type(type),
-                Name(name)
+                Name(name),
+                NameId(0),
+                Scope(rescan_scope::directory),
+                Generation(0)
         {}
     };
+
+    // What the pool does with a new event once a memory budget is exceeded.
+    enum class budget_policy
+    {
+        coalesce, // drop the event if the newest queued one for its name is identical and no reader is past it, otherwise signal
+        signal    // queue a single events_overflowed marker and drop events until back under budget
+    };
+
+    struct memory_budget
+    {
+        size_t Bytes = 0; // queued event storage allowed, 0 means unlimited
+        budget_policy Policy = budget_policy::signal;
+    };
+
+    // How the pool backs its event storage arena.
+    enum class huge_pages
+    {
+        none,        // regular pages
+        transparent, // ask for transparent huge pages with madvise
+        hugetlb      // MAP_HUGETLB, falls back to transparent when no huge pages are reserved
+    };
+
+    struct heatmap_options
+    {
+        size_t Width = 4096;                            // counters per sketch row
+        size_t TopK = 64;                               // hottest paths kept by name
+        std::chrono::seconds HalfLife = std::chrono::seconds(600); // time for a score to halve
+    };
+    
+    struct prefetch_options
+    {
+        size_t MaxFileBytes = 4 * 1024 * 1024;       // read ahead at most this much of each file
+        size_t MaxBytesPerSecond = 256 * 1024 * 1024; // the helper pauses once this much was advised within a second
+        size_t MaxPending = 4096;                     // paths waiting for the helper, newer ones are dropped
+        std::function<bool(std::string_view path)> Filter; // prefetch only matching paths, all when empty
+    };
+    
+    // Last event the pool parsed for one path.
+    struct path_state
+    {
+        directory_event::type Type = directory_event::watch_directory_destroyed;
+        uint64_t Sequence = 0; // pool-wide event number, grows by one per recorded event
+        int64_t Timestamp = 0; // steady clock nanoseconds
+    };
+    
+    struct memory_usage
+    {
+        size_t EventBytes = 0; // queued directory_event records
+        size_t NameBytes = 0;  // interned names, shared by every watch of a pool and not budgeted
+        size_t PathBytes = 0;  // watched path strings
+        size_t TableBytes = 0; // generation, latest event and heatmap tables of a pool
+
+        size_t Total() const
+        {
+            return EventBytes + NameBytes + PathBytes + TableBytes;
+        }
+    };
+    
+    // Per-user inotify limits from /proc/sys/fs/inotify, zero where a value could not be read.
+    struct inotify_limits
+    {
+        uint64_t MaxUserWatches = 0;
+        uint64_t MaxUserInstances = 0;
+        uint64_t MaxQueuedEvents = 0; // per instance
+    };
+    
+    // Drain path stages timed when compiled with WATCH_PROFILE. Stages nest, parse includes
+    // the append of the event it parsed.
+    enum class profile_stage
+    {
+        read,     // read() of the inotify descriptor
+        parse,    // ParseEvent of one record
+        append,   // queueing one event
+        dispatch, // Poll handing one event to a subscriber
+        handoff   // passing a batch to a consumer thread
+    };
+    
+    constexpr size_t ProfileStages = 5;
+    
+    // Durations of one stage in cycles, or nanoseconds where there is no cycle counter.
+    // Buckets[i] counts durations in [2^i, 2^(i+1)), Buckets[0] also counts zero.
+    struct profile_histogram
+    {
+        uint64_t Count = 0;
+        uint64_t Total = 0;
+        uint64_t Buckets[64] = {};
+    };
+    
+    // What a pool's AutoTune chose.
+    struct pool_config
+    {
+        inotify_limits Limits;
+        size_t ExpectedWatches = 0;
+        size_t DrainBufferBytes = 0; // read by one Update
+        size_t QueueEvents = 0;      // events the suggested budget holds
+        size_t BudgetBytes = 0;      // suggested pool budget, not applied until passed to SetBudget
+        unsigned Shards = 1;         // pools to spread the expected watches over
+        bool WatchesFit = true;      // the expected watches stay within max_user_watches
+    };
     
     template<typename PoolType>
     struct generic_directory_watch
@@ -56,8 +216,9 @@ namespace watch
         PoolType* Pool;
         
         id_type NativeHandle = -1;
-        int Ticket = -1;
+        size_t Ticket = 0;
         bool Dead = true;
+        bool TrackingAccess = false;
         
         generic_directory_watch() :
             Pool(0),
@@ -73,7 +234,9 @@ namespace watch
         
         void Destroy()
         {
-            Pool->Destroy(NativeHandle);
+            if(Pool != nullptr)
+                Pool->Destroy(NativeHandle, Ticket);
+            NativeHandle = -1;
             Dead = true;
         }
         
@@ -87,28 +250,98 @@ namespace watch
                 Dead = false;
                 NativeHandle = result.Handle;
                 Ticket = result.Ticket;
+                if(TrackingAccess)
+                    Pool->TrackAccess(NativeHandle);
             }
         }
         
+        // Feeds opens and reads of files in the directory to the pool's access heatmap.
+        int TrackAccess(const heatmap_options& options = {})
+        {
+            TrackingAccess = true;
+            return Dead ? 0 : Pool->TrackAccess(NativeHandle, options);
+        }
+        
         ~generic_directory_watch()
         {
             Destroy();
         }
         
-        bool PollEvent(watch::directory_event& event)
+        void SetBudget(const memory_budget& budget)
+        {
+            if(!Dead)
+                Pool->SetBudget(NativeHandle, budget);
+        }
+        
+        memory_usage MemoryUsage() const
+        {
+            return Dead ? memory_usage() : Pool->Usage(NativeHandle);
+        }
+        
+        // Pending event queries below scan the pool's index, EnableIndex must be called first.
+        void EnableIndex()
+        {
+            if(!Dead)
+                Pool->EnableIndex(NativeHandle);
+        }
+        
+        bool AnyPending(directory_event::type type)
+        {
+            if(Dead)
+                return false;
+            Pool->Update();
+            auto index = Pool->GetIndex(NativeHandle);
+            return index != nullptr && index->Any(Ticket, type);
+        }
+        
+        size_t CountPending(directory_event::type type)
+        {
+            if(Dead)
+                return 0;
+            Pool->Update();
+            auto index = Pool->GetIndex(NativeHandle);
+            return index == nullptr ? 0 : index->Count(Ticket, type);
+        }
+        
+        // Number of pending events for the file called name.
+        size_t CountPending(std::string_view name)
         {
             if(Dead)
-                Recreate();
+                return 0;
+            Pool->Update();
+            auto index = Pool->GetIndex(NativeHandle);
+            if(index == nullptr)
+                return 0;
+            
+            auto nameId = Pool->Names().Find(name);
+            return nameId == 0 ? 0 : index->Count(Ticket, nameId);
+        }
+        
+        // Recreates a dead watch. On success event is set to the subtree marker a subscriber
+        // needs, nothing below the directory was seen while it was unwatched.
+        bool Revive(watch::directory_event& event)
+        {
+            Recreate();
             if(Dead) // Recreate should change Dead to false if it succeeded, if it failed we need to bail.
                 return false;
             
+            event.Type = directory_event::events_overflowed;
+            event.Name.clear();
+            event.NameId = 0;
+            event.Scope = rescan_scope::subtree;
+            event.Generation = Pool->NextRescanGeneration();
+            return true;
+        }
+        
+        bool PollEvent(watch::directory_event& event)
+        {
+            if(Dead)
+                return Revive(event);
+            
             Pool->Update();
-            auto vec = Pool->GetEvents(NativeHandle);
-            if(static_cast<size_t>(Ticket) >= vec.size())
+            if(!Pool->Poll(NativeHandle, Ticket, event))
                 return false;
             
-            event = vec.at(Ticket++);
-            
             if(event.Type == directory_event::watch_directory_destroyed)
                 Dead = true;
             
@@ -121,6 +354,7 @@ namespace watch
     {
         DirectoryWatcherType DirectoryWatcher;
         std::string Filename;
+        uint32_t FilenameId = 0;
     
         static std::string GetDirectory(const std::string& dir)
         {
@@ -141,27 +375,55 @@ namespace watch
             }
             return {};
         }
+        
+        // Like GetDirectory and GetFilename, but a bare name is a file in the current directory.
+        static std::string DirectoryOf(const std::string& path)
+        {
+            std::string dir = GetDirectory(path);
+            return dir.empty() ? std::string("./") : dir;
+        }
+        
+        static std::string FilenameOf(const std::string& path)
+        {
+            std::string name = GetFilename(path);
+            return name.empty() && path.find('/') == std::string::npos ? path : name;
+        }
 
         generic_file_watcher() :
             DirectoryWatcher()
         {}
     
+        // The filename stays pinned in the pool, so its id can be compared with event ids. A
+        // bare name is a file in the current directory.
         explicit generic_file_watcher(const std::string& dir,
                                       typename DirectoryWatcherType::pool_type* ptr) :
-                DirectoryWatcher(GetDirectory(dir), ptr),
-                Filename(GetFilename(dir))
+                DirectoryWatcher(DirectoryOf(dir), ptr),
+                Filename(FilenameOf(dir)),
+                FilenameId(ptr->PinName(Filename))
         {}
         
         generic_file_watcher(const std::string& dir, const std::string& file) :
                 DirectoryWatcher(dir),
-                Filename(file)
+                Filename(file),
+                FilenameId(DirectoryWatcher.Pool->PinName(Filename))
         { }
         
+        generic_file_watcher(const generic_file_watcher&) = delete;
+        generic_file_watcher& operator=(const generic_file_watcher&) = delete;
+        
+        ~generic_file_watcher()
+        {
+            if(DirectoryWatcher.Pool != nullptr)
+                DirectoryWatcher.Pool->UnpinName(FilenameId);
+        }
+        
         bool PollEvent(watch::directory_event& event)
         {
             while(DirectoryWatcher.PollEvent(event))
             {
-                if(event.Name == Filename)
+                if(event.Type == directory_event::events_overflowed)
+                    return true; // the file may have changed without an event
+                if(event.NameId == FilenameId && FilenameId != 0)
                     return true;
             }
             return false;
@@ -179,133 +441,2353 @@ namespace watch_impl
         no_copy(no_copy&&) = delete;
         no_copy operator=(const no_copy&) = delete;
     };
-
-#ifdef __unix__
-    class inotify_watch_pool : public no_copy
+    
+    // splitmix64 finalizer, spreads every input bit over the whole word.
+    inline uint64_t mix(uint64_t x)
+    {
+        x ^= x >> 30;
+        x *= 0xbf58476d1ce4e5b9ull;
+        x ^= x >> 27;
+        x *= 0x94d049bb133111ebull;
+        x ^= x >> 31;
+        return x;
+    }
+    
+#ifdef WATCH_PROFILE
+    struct profile_counters
+    {
+        std::atomic<uint64_t> Count{0};
+        std::atomic<uint64_t> Total{0};
+        std::atomic<uint64_t> Buckets[64] = {};
+    };
+    
+    inline profile_counters* profile_data()
+    {
+        static profile_counters counters[watch::ProfileStages];
+        return counters;
+    }
+    
+    inline uint64_t profile_clock()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        return (uint64_t)std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+    }
+    
+    // Adds the time between construction and destruction to its stage's histogram.
+    class profile_scope : public no_copy
     {
+        profile_counters& counters_;
+        uint64_t start_;
+        
     public:
-        using id_type = int;
-
-    private:
-        int handleInotify_;
+        explicit profile_scope(watch::profile_stage stage) :
+            counters_(profile_data()[(size_t)stage]),
+            start_(profile_clock())
+        {}
         
+        ~profile_scope()
+        {
+            uint64_t elapsed = profile_clock() - start_;
+            size_t bucket = elapsed == 0 ? 0 : 63 - __builtin_clzll(elapsed);
+            counters_.Count.fetch_add(1, std::memory_order_relaxed);
+            counters_.Total.fetch_add(elapsed, std::memory_order_relaxed);
+            counters_.Buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+        }
+    };
+#endif
+
+    // Hands out fixed-size chunks carved from large blocks, released chunks go on a freelist
+    // and are reused before a new block is mapped. Blocks are only returned to the system
+    // when the arena is destroyed.
+    class chunk_arena : public no_copy
+    {
+    public:
+        constexpr static size_t ChunkBytes = 4096;
+        constexpr static size_t BlockBytes = 2 * 1024 * 1024;
         
-        std::unordered_map<id_type, std::vector<watch::directory_event>> events_ = {};
+    private:
+        struct free_chunk
+        {
+            free_chunk* Next;
+        };
         
-        unsigned char* eventBuffer_ = (unsigned char*)std::calloc(1, 4096);
+        struct block
+        {
+            void* Memory;
+            bool Explicit; // mapped with MAP_HUGETLB
+        };
         
-        constexpr static uint32_t DeadFlags = (IN_IGNORED | IN_Q_OVERFLOW | IN_UNMOUNT);
-        constexpr static uint32_t FileCreatedFlags = (IN_CREATE | IN_MOVED_TO);
-        constexpr static uint32_t FileDeletedFlags= (IN_MOVED_FROM| IN_DELETE);
-        constexpr static uint32_t FileModifiedFlags= (IN_MODIFY | IN_CLOSE_WRITE);
+        watch::huge_pages mode_;
+        std::pmr::memory_resource* upstream_; // blocks come from here instead of mmap when set
+        free_chunk* free_ = nullptr;
+        std::pmr::vector<block> blocks_;
+        size_t chunksInUse_ = 0;
         
-        uint32_t TranslateToFlags(watch::directory_event::type event)
+        static block MapExplicit()
         {
-            using ev = watch::directory_event::type;
-            if(event == ev::file_created) return FileCreatedFlags;
-            if(event == ev::file_deleted) return FileDeletedFlags;
-            if(event == ev::file_modified) return FileModifiedFlags;
-            return 0;
+#ifdef MAP_HUGETLB
+            void* mapping = mmap(nullptr, BlockBytes, PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if(mapping != MAP_FAILED)
+                return {mapping, true};
+#endif
+            return {nullptr, false};
         }
         
+        // Maps a block aligned to its own size so it can be backed by a transparent huge page.
+        static block MapAligned(bool adviseHuge)
+        {
+            void* mapping = mmap(nullptr, 2 * BlockBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if(mapping == MAP_FAILED)
+                throw std::bad_alloc();
+            
+            uintptr_t start = (uintptr_t)mapping;
+            uintptr_t aligned = (start + BlockBytes - 1) & ~(uintptr_t)(BlockBytes - 1);
+            if(aligned != start)
+                munmap(mapping, aligned - start);
+            munmap((void*)(aligned + BlockBytes), start + BlockBytes - aligned);
+            
+#ifdef MADV_HUGEPAGE
+            if(adviseHuge)
+                madvise((void*)aligned, BlockBytes, MADV_HUGEPAGE); // best effort, fails without THP support
+#else
+            (void)adviseHuge;
+#endif
+            return {(void*)aligned, false};
+        }
         
-        void ParseEvent(inotify_event& event)
+        block MapBlock()
         {
-            LOG("Parse " << event.mask);
+            if(upstream_ != nullptr)
+                return {upstream_->allocate(BlockBytes, alignof(std::max_align_t)), false};
             
-            std::vector<watch::directory_event>& vec = events_[event.wd];
-   
-            if((event.mask & DeadFlags) != 0)
+            if(mode_ == watch::huge_pages::hugetlb)
             {
-                // dead
-                vec.emplace_back();
+                block result = MapExplicit();
+                if(result.Memory != nullptr)
+                    return result;
             }
-            else
+            return MapAligned(mode_ != watch::huge_pages::none);
+        }
+        
+        void Grow()
+        {
+            block mapped = MapBlock();
+            blocks_.push_back(mapped);
+            unsigned char* memory = (unsigned char*)mapped.Memory;
+            for(size_t offset = BlockBytes; offset != 0; offset -= ChunkBytes)
             {
-                if((event.mask & FileCreatedFlags) != 0)
-                    vec.emplace_back(watch::directory_event::file_created, std::string(event.name));
-                
-                else if((event.mask & FileDeletedFlags) != 0)
-                    vec.emplace_back(watch::directory_event::file_deleted, std::string(event.name));
-                
-                else if((event.mask & FileModifiedFlags) != 0)
-                    vec.emplace_back(watch::directory_event::file_modified, std::string(event.name));
-                
+                free_chunk* chunk = (free_chunk*)(memory + offset - ChunkBytes);
+                chunk->Next = free_;
+                free_ = chunk;
             }
         }
-    
+        
     public:
-
-        inotify_watch_pool() :
-                handleInotify_(inotify_init1(IN_NONBLOCK))
+        explicit chunk_arena(watch::huge_pages mode = watch::huge_pages::none) :
+            mode_(mode),
+            upstream_(nullptr)
+        {}
+        
+        explicit chunk_arena(std::pmr::memory_resource* upstream) :
+            mode_(watch::huge_pages::none),
+            upstream_(upstream),
+            blocks_(upstream)
+        {}
+        
+        ~chunk_arena()
         {
+            for(const block& mapped : blocks_)
+            {
+                if(upstream_ != nullptr)
+                    upstream_->deallocate(mapped.Memory, BlockBytes, alignof(std::max_align_t));
+                else
+                    munmap(mapped.Memory, BlockBytes);
+            }
         }
         
-        ~inotify_watch_pool()
+        void* Acquire()
+        {
+            if(free_ == nullptr)
+                Grow();
+            free_chunk* chunk = free_;
+            free_ = chunk->Next;
+            chunksInUse_++;
+            return chunk;
+        }
+        
+        void Release(void* ptr)
+        {
+            free_chunk* chunk = (free_chunk*)ptr;
+            chunk->Next = free_;
+            free_ = chunk;
+            chunksInUse_--;
+        }
+        
+        size_t ReservedBytes() const
+        {
+            return blocks_.size() * BlockBytes;
+        }
+        
+        size_t UsedBytes() const
+        {
+            return chunksInUse_ * ChunkBytes;
+        }
+        
+        // Bytes actually mapped from the reserved huge page pool, transparent huge pages are
+        // up to the kernel and only visible in /proc/self/smaps.
+        size_t ExplicitHugeBytes() const
         {
-            std::free(eventBuffer_);
+            size_t count = 0;
+            for(const block& mapped : blocks_)
+                count += mapped.Explicit ? 1 : 0;
+            return count * BlockBytes;
         }
+    };
     
-        struct create_result
+    // Queue stored in arena chunks and addressed by absolute position, positions stay valid
+    // for the lifetime of the queue. Appending never moves existing elements, chunks that
+    // fall entirely behind TrimFront are handed back to the arena.
+    template<typename T>
+    class segmented_queue : public no_copy
+    {
+    public:
+        constexpr static size_t ChunkCapacity = chunk_arena::ChunkBytes / sizeof(T);
+        static_assert(ChunkCapacity > 0, "element does not fit in an arena chunk");
+        
+    private:
+        chunk_arena* arena_;
+        std::pmr::vector<T*> chunks_;
+        size_t firstChunk_ = 0; // chunks_ before this index were released
+        size_t base_ = 0;       // position of the first element of chunks_[firstChunk_]
+        size_t begin_ = 0;
+        size_t end_ = 0;
+        
+        T* Slot(size_t position) const
         {
-            int Error = 0;
-            id_type Handle;
-            std::vector<watch::directory_event>::size_type Ticket;
-        };
+            size_t relative = position - base_;
+            return chunks_[firstChunk_ + relative / ChunkCapacity] + relative % ChunkCapacity;
+        }
         
-        create_result Create(const char* file)
+    public:
+        segmented_queue(chunk_arena* arena, std::pmr::memory_resource* resource) :
+            arena_(arena),
+            chunks_(resource)
+        {}
+        
+        ~segmented_queue()
         {
-            uint32_t flags =  FileCreatedFlags | FileDeletedFlags | FileModifiedFlags;
-            
-            id_type handle = inotify_add_watch(handleInotify_, file, flags);
-            
-            create_result result;
-            result.Error = (handle == -1 ? errno : 0);
-            result.Handle = handle;
-            result.Ticket = (handle == -1 ? 0 : events_[handle].size());
-            return result;
+            TrimFront(end_, [](const T&){});
+            for(size_t i = firstChunk_; i < chunks_.size(); i++)
+                arena_->Release(chunks_[i]);
         }
         
-        void Destroy(id_type id)
+        size_t Begin() const { return begin_; }
+        size_t End() const { return end_; }
+        size_t Size() const { return end_ - begin_; }
+        size_t Chunks() const { return chunks_.size() - firstChunk_; }
+        
+        const T& operator[](size_t position) const
         {
-            if(id == -1)
-                return;
+            return *Slot(position);
+        }
+        
+        template<typename... Args>
+        T& EmplaceBack(Args&&... args)
+        {
+            if(end_ - base_ == Chunks() * ChunkCapacity)
+                chunks_.push_back((T*)arena_->Acquire());
             
-            // TODO : invalid read on watch dtor here (valgrind)
-            inotify_rm_watch(handleInotify_, id);
+            T* slot = Slot(end_);
+            new(slot) T(std::forward<Args>(args)...);
+            end_++;
+            return *slot;
         }
         
-        void Update()
+        // Destroys every element before position, calling onRemove on each first.
+        template<typename Fn>
+        void TrimFront(size_t position, Fn&& onRemove)
         {
-            constexpr static uint32_t MaxEventSize = sizeof(inotify_event) + NAME_MAX + 1;
-            ssize_t len =  read(handleInotify_, eventBuffer_, MaxEventSize);
-            ssize_t offset = 0;
+            if(position > end_)
+                position = end_;
             
-            if(len == -1)
-                return;
-      
-            while(len > offset)
+            for(; begin_ < position; begin_++)
             {
-                inotify_event* ev = (inotify_event*)(offset + eventBuffer_);
-                ParseEvent(*ev);
-                offset += sizeof(ev->mask) + sizeof(ev->wd) + sizeof(ev->cookie) + sizeof(ev->len) + ev->len;
+                T* slot = Slot(begin_);
+                onRemove(*slot);
+                slot->~T();
+            }
+            
+            while(Chunks() > 0 && begin_ - base_ >= ChunkCapacity)
+            {
+                arena_->Release(chunks_[firstChunk_++]);
+                base_ += ChunkCapacity;
+            }
+            
+            if(firstChunk_ > 32 && firstChunk_ * 2 > chunks_.size())
+            {
+                chunks_.erase(chunks_.begin(), chunks_.begin() + firstChunk_);
+                firstChunk_ = 0;
             }
         }
+    };
+
+    // Interns file names to 32-bit ids, each distinct name is stored once in arena chunks.
+    // Names are reference counted by the events and watchers using them; once the last
+    // reference is released the id is reused for another name, and the storage of released
+    // names is reclaimed by compacting the live ones when they take up less than half of it.
+    // Only the pool's thread interns and releases, any thread may look names and ids up; a view
+    // returned by NameOf stays valid until the next Release.
+    class name_table : public no_copy
+    {
+    public:
+        using id_type = uint32_t;
         
-        const std::vector<watch::directory_event>& GetEvents(id_type watch)
+        constexpr static id_type NoName = 0;
+        
+    private:
+        mutable std::shared_mutex mutex_;
+        chunk_arena* arena_;
+        std::pmr::vector<void*> chunks_;
+        char* cursor_ = nullptr;
+        size_t remaining_ = 0;
+        std::pmr::unordered_map<std::string_view, id_type> ids_;
+        std::pmr::vector<std::string_view> names_;
+        std::pmr::vector<uint32_t> refs_; // touched by the pool's thread only
+        std::pmr::vector<id_type> free_;
+        size_t deadBytes_ = 0; // stored bytes of released names
+        
+        std::string_view Store(std::string_view name)
         {
-            return events_[watch];
+            if(name.size() > remaining_)
+            {
+                cursor_ = (char*)arena_->Acquire();
+                remaining_ = chunk_arena::ChunkBytes;
+                chunks_.push_back(cursor_);
+            }
+            std::memcpy(cursor_, name.data(), name.size());
+            std::string_view stored(cursor_, name.size());
+            cursor_ += name.size();
+            remaining_ -= name.size();
+            return stored;
         }
-    };
-#endif
-}
-
-namespace watch
-{
-#if __unix__
-    using global_watch_pool_type = watch_impl::inotify_watch_pool;
-#endif
-    
-    using directory = generic_directory_watch<global_watch_pool_type>;
-    using file = generic_file_watcher<directory>;
+        
+        // Copies the live names into fresh chunks. Caller holds the unique lock.
+        void Compact()
+        {
+            std::pmr::vector<void*> old(chunks_.get_allocator());
+            old.swap(chunks_);
+            cursor_ = nullptr;
+            remaining_ = 0;
+            ids_.clear();
+            for(id_type id = 1; id < names_.size(); id++)
+            {
+                if(refs_[id] == 0)
+                    continue;
+                names_[id] = Store(names_[id]);
+                ids_.emplace(names_[id], id);
+            }
+            for(void* chunk : old)
+                arena_->Release(chunk);
+            deadBytes_ = 0;
+        }
+        
+    public:
+        name_table(chunk_arena* arena, std::pmr::memory_resource* resource) :
+            arena_(arena),
+            chunks_(resource),
+            ids_(resource),
+            names_(resource),
+            refs_(resource),
+            free_(resource)
+        {
+            names_.emplace_back();
+            refs_.push_back(0);
+        }
+        
+        ~name_table()
+        {
+            for(void* chunk : chunks_)
+                arena_->Release(chunk);
+        }
+        
+        // Returns the id of name with one more reference on it, NoName for an empty name or one
+        // longer than NAME_MAX, which no directory entry can have and a chunk might not hold.
+        id_type Intern(std::string_view name)
+        {
+            if(name.empty() || name.size() > NAME_MAX)
+                return NoName;
+            
+            {
+                std::shared_lock<std::shared_mutex> lock(mutex_);
+                auto iter = ids_.find(name);
+                if(iter != ids_.end())
+                {
+                    refs_[iter->second]++;
+                    return iter->second;
+                }
+            }
+            
+            std::unique_lock<std::shared_mutex> lock(mutex_);
+            std::string_view stored = Store(name);
+            id_type id;
+            if(free_.empty())
+            {
+                id = static_cast<id_type>(names_.size());
+                names_.push_back(stored);
+                refs_.push_back(1);
+            }
+            else
+            {
+                id = free_.back();
+                free_.pop_back();
+                names_[id] = stored;
+                refs_[id] = 1;
+            }
+            ids_.emplace(stored, id);
+            return id;
+        }
+        
+        void Acquire(id_type id)
+        {
+            if(id != NoName)
+                refs_[id]++;
+        }
+        
+        // Drops one reference, the id may name something else once the last one is gone.
+        void Release(id_type id)
+        {
+            if(id == NoName || --refs_[id] != 0)
+                return;
+            
+            std::unique_lock<std::shared_mutex> lock(mutex_);
+            ids_.erase(names_[id]);
+            deadBytes_ += names_[id].size();
+            names_[id] = std::string_view();
+            free_.push_back(id);
+            if(chunks_.size() > 1 && deadBytes_ * 2 > chunks_.size() * chunk_arena::ChunkBytes)
+                Compact();
+        }
+        
+        // Id of a name currently interned, NoName if nothing refers to it.
+        id_type Find(std::string_view name) const
+        {
+            std::shared_lock<std::shared_mutex> lock(mutex_);
+            auto iter = ids_.find(name);
+            return iter == ids_.end() ? NoName : iter->second;
+        }
+        
+        // The view points into the table and moves when the pool's thread compacts it, only that
+        // thread may hold on to it.
+        std::string_view NameOf(id_type id) const
+        {
+            std::shared_lock<std::shared_mutex> lock(mutex_);
+            return id < names_.size() ? names_[id] : std::string_view();
+        }
+        
+        // Names currently interned.
+        size_t Size() const
+        {
+            std::shared_lock<std::shared_mutex> lock(mutex_);
+            return ids_.size();
+        }
+        
+        size_t Bytes() const
+        {
+            std::shared_lock<std::shared_mutex> lock(mutex_);
+            return chunks_.size() * chunk_arena::ChunkBytes +
+                   names_.capacity() * (sizeof(std::string_view) + sizeof(uint32_t)) +
+                   free_.capacity() * sizeof(id_type) +
+                   ids_.size() * (sizeof(std::string_view) + sizeof(id_type) + 2 * sizeof(void*));
+        }
+    };
+    
+    // Lock-free table of 64-bit generations keyed by path hash. The pool is the only writer, any
+    // thread may read. Every bump hands out the next value of one pool-wide counter, so a path's
+    // generation never repeats and "is it still G?" needs a single comparison. Buckets hold a
+    // fixed number of slots and entries are never removed, a path that finds its bucket full
+    // shares the bucket's overflow generation, which can only cause extra invalidations.
+    // Besides its own generation, every watched directory has a loss generation, bumped when
+    // its events were lost; looking up a path folds in the loss generation of its directory.
+    //
+    // The table is one self-describing region and can live in a memfd, letting other processes
+    // map it read-only and check generations without an inotify descriptor of their own. Each
+    // bucket is guarded by a seqlock: the writer makes the bucket's sequence odd, updates it and
+    // makes it even again, readers retry while the sequence is odd or changed under them.
+    // Retries are bounded, a publisher that died halfway through a write leaves its bucket odd
+    // for good and readers of it get Unavailable instead of hanging.
+    class generation_table : public no_copy
+    {
+    public:
+        constexpr static size_t BucketSlots = 7;
+        constexpr static uint32_t SpinReadRetries = 1024;  // then yield, the writer may be preempted
+        constexpr static uint32_t MaxReadRetries = 1 << 16; // tens of milliseconds in all
+        
+        // Returned by Load when the bucket stayed locked for MaxReadRetries attempts. It is
+        // above every generation, so it always reads as changed; don't record it as a
+        // generation to compare against later.
+        constexpr static uint64_t Unavailable = UINT64_MAX;
+        constexpr static uint64_t Magic = 0x7774636867656e73ull; // "wtchgens"
+        constexpr static uint32_t Version = 2;
+        
+        // FNV-1a, stable across processes and builds. Paths are hashed as spelled, without
+        // trailing slashes, so "/a/b/" and "/a/b" are the same path but "/a/./b" is not.
+        struct path_hash
+        {
+            uint64_t State = 14695981039346656037ull;
+            
+            path_hash& Append(std::string_view part)
+            {
+                while(!part.empty() && part.back() == '/' && part.size() > 1)
+                    part.remove_suffix(1);
+                for(char c : part)
+                {
+                    State ^= static_cast<unsigned char>(c);
+                    State *= 1099511628211ull;
+                }
+                return *this;
+            }
+            
+            path_hash& Separator()
+            {
+                return Append("/");
+            }
+            
+            // Turns the hash of a directory into the key of its loss generation, no file name
+            // contains a zero byte.
+            path_hash& Loss()
+            {
+                return Separator().Append(std::string_view("", 1));
+            }
+            
+            // Zero marks an empty slot, so it is never used as a key.
+            uint64_t Key() const
+            {
+                return State == 0 ? 1 : State;
+            }
+        };
+        
+        static uint64_t HashPath(std::string_view path)
+        {
+            return path_hash().Append(path).Key();
+        }
+        
+        // Directory part of a path as spelled, empty for a bare name.
+        static std::string_view ParentOf(std::string_view path)
+        {
+            while(path.size() > 1 && path.back() == '/')
+                path.remove_suffix(1);
+            size_t slash = path.rfind('/');
+            if(slash == std::string_view::npos)
+                return std::string_view();
+            return path.substr(0, slash == 0 ? 1 : slash);
+        }
+        
+    private:
+        struct alignas(64) header
+        {
+            uint64_t Magic;
+            uint32_t Version;
+            uint32_t BucketSlots;
+            uint64_t BucketCount;
+            std::atomic<uint64_t> Next; // last generation handed out
+        };
+        
+        struct slot
+        {
+            std::atomic<uint64_t> Key;
+            std::atomic<uint64_t> Generation;
+        };
+        
+        struct alignas(64) bucket
+        {
+            std::atomic<uint64_t> Sequence;
+            std::atomic<uint64_t> Overflow;
+            slot Slots[BucketSlots];
+        };
+        
+        static_assert(std::atomic<uint64_t>::is_always_lock_free, "shared generations need address-free atomics");
+        
+        header* header_ = nullptr;
+        bucket* buckets_ = nullptr;
+        size_t mask_ = 0;
+        size_t bytes_ = 0;
+        std::pmr::memory_resource* resource_ = nullptr; // set when the region was allocated, else it is mapped
+        int descriptor_ = -1;
+        
+        generation_table() = default;
+        
+        static size_t RegionBytes(size_t bucketCount)
+        {
+            return sizeof(header) + bucketCount * sizeof(bucket);
+        }
+        
+        static size_t RoundUp(size_t bucketCount)
+        {
+            size_t count = 1;
+            while(count < bucketCount)
+                count *= 2;
+            return count;
+        }
+        
+        void Bind(void* region, size_t bucketCount)
+        {
+            header_ = (header*)region;
+            buckets_ = (bucket*)((unsigned char*)region + sizeof(header));
+            mask_ = bucketCount - 1;
+            bytes_ = RegionBytes(bucketCount);
+        }
+        
+        void Format(size_t bucketCount)
+        {
+            new(header_) header();
+            header_->Magic = Magic;
+            header_->Version = Version;
+            header_->BucketSlots = BucketSlots;
+            header_->BucketCount = bucketCount;
+            for(size_t i = 0; i < bucketCount; i++)
+                new(&buckets_[i]) bucket();
+        }
+        
+        bucket& BucketOf(uint64_t key) const
+        {
+            return buckets_[(key ^ (key >> 29)) & mask_];
+        }
+        
+        static void Write(bucket& target, slot* entry, uint64_t key, uint64_t generation)
+        {
+            uint64_t sequence = target.Sequence.load(std::memory_order_relaxed);
+            target.Sequence.store(sequence + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            
+            if(entry == nullptr)
+                target.Overflow.store(generation, std::memory_order_relaxed);
+            else
+            {
+                entry->Generation.store(generation, std::memory_order_relaxed);
+                entry->Key.store(key, std::memory_order_relaxed);
+            }
+            
+            target.Sequence.store(sequence + 2, std::memory_order_release);
+        }
+        
+    public:
+        // Private table, bucketCount is rounded up to a power of two.
+        generation_table(size_t bucketCount, std::pmr::memory_resource* resource) :
+            resource_(resource)
+        {
+            size_t count = RoundUp(bucketCount);
+            Bind(resource_->allocate(RegionBytes(count), alignof(bucket)), count);
+            Format(count);
+        }
+        
+        // Table in a sealed memfd that other processes can Attach to. Returns null and sets error
+        // to errno on failure.
+        static std::unique_ptr<generation_table> CreateShared(size_t bucketCount, int* error = nullptr)
+        {
+            size_t count = RoundUp(bucketCount);
+            size_t bytes = RegionBytes(count);
+            
+            int fd = memfd_create("watch-generations", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+            void* region = MAP_FAILED;
+            if(fd != -1 && ftruncate(fd, (off_t)bytes) == 0)
+                region = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if(region == MAP_FAILED)
+            {
+                if(error != nullptr)
+                    *error = errno;
+                if(fd != -1)
+                    close(fd);
+                return nullptr;
+            }
+            fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+            
+            std::unique_ptr<generation_table> table(new generation_table());
+            table->descriptor_ = fd;
+            table->Bind(region, count);
+            table->Format(count);
+            return table;
+        }
+        
+        // Read-only view of a table another process created with CreateShared, for example
+        // through a descriptor passed over a unix socket or /proc/<pid>/fd/<n>. Returns null and
+        // sets error to errno, or EINVAL for a region that is not a compatible table.
+        static std::unique_ptr<generation_table> Attach(int fd, int* error = nullptr)
+        {
+            struct stat info;
+            void* region = MAP_FAILED;
+            if(fstat(fd, &info) == 0 && (size_t)info.st_size >= sizeof(header))
+                region = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if(region == MAP_FAILED)
+            {
+                if(error != nullptr)
+                    *error = (errno != 0 ? errno : EINVAL);
+                return nullptr;
+            }
+            
+            const header* shared = (const header*)region;
+            bool compatible = shared->Magic == Magic && shared->Version == Version &&
+                              shared->BucketSlots == BucketSlots && shared->BucketCount != 0 &&
+                              (shared->BucketCount & (shared->BucketCount - 1)) == 0 &&
+                              RegionBytes(shared->BucketCount) <= (size_t)info.st_size;
+            if(!compatible)
+            {
+                munmap(region, (size_t)info.st_size);
+                if(error != nullptr)
+                    *error = EINVAL;
+                return nullptr;
+            }
+            
+            std::unique_ptr<generation_table> table(new generation_table());
+            table->Bind(region, shared->BucketCount);
+            table->bytes_ = (size_t)info.st_size;
+            return table;
+        }
+        
+        ~generation_table()
+        {
+            if(resource_ != nullptr)
+                resource_->deallocate(header_, bytes_, alignof(bucket));
+            else if(header_ != nullptr)
+                munmap(header_, bytes_);
+            if(descriptor_ != -1)
+                close(descriptor_);
+        }
+        
+        // memfd holding a shared table, -1 for private and attached tables.
+        int Descriptor() const
+        {
+            return descriptor_;
+        }
+        
+        // Writer only.
+        uint64_t Bump(uint64_t key)
+        {
+            uint64_t generation = header_->Next.load(std::memory_order_relaxed) + 1;
+            header_->Next.store(generation, std::memory_order_relaxed);
+            
+            bucket& target = BucketOf(key);
+            for(slot& entry : target.Slots)
+            {
+                uint64_t current = entry.Key.load(std::memory_order_relaxed);
+                if(current == key || current == 0)
+                {
+                    Write(target, &entry, key, generation);
+                    return generation;
+                }
+            }
+            Write(target, nullptr, key, generation);
+            return generation;
+        }
+        
+        // Current generation of a path, zero if nothing happened to it (or its bucket) yet.
+        uint64_t Load(uint64_t key) const
+        {
+            const bucket& source = BucketOf(key);
+            for(uint32_t attempt = 0; attempt < MaxReadRetries; attempt++)
+            {
+                if(attempt >= SpinReadRetries)
+                    std::this_thread::yield();
+                uint64_t before = source.Sequence.load(std::memory_order_acquire);
+                if((before & 1) != 0)
+                    continue;
+                
+                uint64_t generation = 0;
+                bool found = false;
+                for(const slot& entry : source.Slots)
+                {
+                    uint64_t current = entry.Key.load(std::memory_order_relaxed);
+                    if(current == key)
+                    {
+                        generation = entry.Generation.load(std::memory_order_relaxed);
+                        found = true;
+                        break;
+                    }
+                    if(current == 0)
+                        break;
+                }
+                if(!found)
+                    generation = source.Overflow.load(std::memory_order_relaxed);
+                
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if(source.Sequence.load(std::memory_order_relaxed) == before)
+                    return generation;
+            }
+            return Unavailable;
+        }
+        
+        // Generation of a path, never below the loss generation of its directory.
+        uint64_t Load(std::string_view path) const
+        {
+            uint64_t generation = Load(HashPath(path));
+            std::string_view parent = ParentOf(path);
+            if(!parent.empty())
+                generation = std::max(generation, Load(path_hash().Append(parent).Loss().Key()));
+            return generation;
+        }
+        
+        size_t Bytes() const
+        {
+            return bytes_;
+        }
+    };
+    
+    // Last event per path in a set-associative table of fixed size. Every slot is its own
+    // seqlock, so readers on any thread take no lock and retry only when they raced with a
+    // write to the slot they read. A full bucket evicts its least recently updated path;
+    // reads cannot reorder entries, they never write.
+    class latest_table : public no_copy
+    {
+    public:
+        constexpr static size_t BucketSlots = 4;
+        
+    private:
+        struct slot
+        {
+            std::atomic<uint64_t> Version; // odd while the slot is being written
+            std::atomic<uint64_t> Key;
+            std::atomic<uint64_t> Stamp;   // sequence << 8 | type
+            std::atomic<int64_t> Timestamp;
+        };
+        
+        struct alignas(64) bucket
+        {
+            slot Slots[BucketSlots];
+        };
+        
+        bucket* buckets_;
+        size_t mask_;
+        std::pmr::memory_resource* resource_;
+        
+        bucket& BucketOf(uint64_t key) const
+        {
+            return buckets_[(key ^ (key >> 29)) & mask_];
+        }
+        
+    public:
+        // bucketCount is rounded up to a power of two.
+        latest_table(size_t bucketCount, std::pmr::memory_resource* resource) :
+            resource_(resource)
+        {
+            size_t count = 1;
+            while(count < bucketCount)
+                count *= 2;
+            mask_ = count - 1;
+            buckets_ = (bucket*)resource_->allocate(count * sizeof(bucket), alignof(bucket));
+            for(size_t i = 0; i < count; i++)
+                new(&buckets_[i]) bucket();
+        }
+        
+        ~latest_table()
+        {
+            resource_->deallocate(buckets_, Bytes(), alignof(bucket));
+        }
+        
+        // Writer only. key must not be zero, which marks an empty slot.
+        void Store(uint64_t key, watch::directory_event::type type, uint64_t sequence, int64_t timestamp)
+        {
+            bucket& target = BucketOf(key);
+            slot* entry = nullptr;
+            for(slot& candidate : target.Slots)
+            {
+                uint64_t current = candidate.Key.load(std::memory_order_relaxed);
+                if(current == key || current == 0)
+                {
+                    entry = &candidate;
+                    break;
+                }
+                if(entry == nullptr || candidate.Stamp.load(std::memory_order_relaxed) < entry->Stamp.load(std::memory_order_relaxed))
+                    entry = &candidate;
+            }
+            
+            uint64_t version = entry->Version.load(std::memory_order_relaxed);
+            entry->Version.store(version + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            entry->Key.store(key, std::memory_order_relaxed);
+            entry->Stamp.store(sequence << 8 | static_cast<uint64_t>(type), std::memory_order_relaxed);
+            entry->Timestamp.store(timestamp, std::memory_order_relaxed);
+            entry->Version.store(version + 2, std::memory_order_release);
+        }
+        
+        // Safe to call from any thread. Returns false if key has no record, never had one or was evicted.
+        bool Load(uint64_t key, watch::path_state& state) const
+        {
+            const bucket& source = BucketOf(key);
+            for(const slot& entry : source.Slots)
+            {
+                for(;;)
+                {
+                    uint64_t before = entry.Version.load(std::memory_order_acquire);
+                    if((before & 1) != 0)
+                        continue;
+                    
+                    uint64_t current = entry.Key.load(std::memory_order_relaxed);
+                    uint64_t stamp = entry.Stamp.load(std::memory_order_relaxed);
+                    int64_t timestamp = entry.Timestamp.load(std::memory_order_relaxed);
+                    
+                    std::atomic_thread_fence(std::memory_order_acquire);
+                    if(entry.Version.load(std::memory_order_relaxed) != before)
+                        continue;
+                    if(current != key)
+                        break;
+                    
+                    state.Type = static_cast<watch::directory_event::type>(stamp & 0xff);
+                    state.Sequence = stamp >> 8;
+                    state.Timestamp = timestamp;
+                    return true;
+                }
+            }
+            return false;
+        }
+        
+        bool Load(std::string_view path, watch::path_state& state) const
+        {
+            return Load(generation_table::HashPath(path), state);
+        }
+        
+        size_t Bytes() const
+        {
+            return (mask_ + 1) * sizeof(bucket);
+        }
+    };
+    
+    // Decayed access scores per path: a count-min sketch for every path plus the top-K hottest by
+    // name. Scores decay exponentially with the configured half-life. Rather than touching every
+    // counter as time passes, new hits are weighted by 2^(elapsed/half-life) and reads divide by
+    // the current weight; counters are rescaled once that weight grows large.
+    class access_heatmap : public no_copy
+    {
+    public:
+        struct entry
+        {
+            std::string Path;
+            double Score;
+        };
+        
+    private:
+        constexpr static size_t Depth = 4;
+        constexpr static double RescaleAbove = 1e12;
+        
+        struct hot_path
+        {
+            uint64_t Key;
+            std::string Path;
+            double Weighted;
+        };
+        
+        size_t mask_;
+        size_t topK_;
+        double halfLifeNs_;
+        int64_t epoch_;  // steady clock nanoseconds where the weight is 1
+        std::vector<double> counters_; // Depth rows of mask_ + 1 counters
+        std::vector<hot_path> hottest_;
+        
+        static int64_t Now()
+        {
+            auto now = std::chrono::steady_clock::now().time_since_epoch();
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(now).count();
+        }
+        
+        double Weight(int64_t now) const
+        {
+            return std::exp2(double(now - epoch_) / halfLifeNs_);
+        }
+        
+        size_t Index(size_t row, uint64_t key) const
+        {
+            uint64_t mixed = (key + row * 0x9e3779b97f4a7c15ull) * 0xff51afd7ed558ccdull;
+            return row * (mask_ + 1) + ((mixed ^ (mixed >> 32)) & mask_);
+        }
+        
+        double Estimate(uint64_t key) const
+        {
+            double estimate = counters_[Index(0, key)];
+            for(size_t row = 1; row < Depth; row++)
+                estimate = std::min(estimate, counters_[Index(row, key)]);
+            return estimate;
+        }
+        
+        void Rescale(int64_t now)
+        {
+            double weight = Weight(now);
+            for(double& counter : counters_)
+                counter /= weight;
+            for(hot_path& hot : hottest_)
+                hot.Weighted /= weight;
+            epoch_ = now;
+        }
+        
+    public:
+        explicit access_heatmap(const watch::heatmap_options& options) :
+            topK_(options.TopK),
+            halfLifeNs_(double(std::chrono::duration_cast<std::chrono::nanoseconds>(options.HalfLife).count())),
+            epoch_(Now())
+        {
+            size_t width = 1;
+            while(width < options.Width)
+                width *= 2;
+            mask_ = width - 1;
+            counters_.assign(Depth * width, 0.0);
+            if(halfLifeNs_ <= 0)
+                halfLifeNs_ = 1;
+        }
+        
+        // makePath builds the path string, it is only called when the path enters the top-K.
+        template<typename MakePath>
+        void Record(uint64_t key, MakePath&& makePath)
+        {
+            int64_t now = Now();
+            double weight = Weight(now);
+            if(weight > RescaleAbove)
+            {
+                Rescale(now);
+                weight = 1;
+            }
+            
+            // conservative update: only raise the counters that hold the minimum
+            double estimate = Estimate(key) + weight;
+            for(size_t row = 0; row < Depth; row++)
+            {
+                double& counter = counters_[Index(row, key)];
+                counter = std::max(counter, estimate);
+            }
+            
+            if(topK_ == 0)
+                return;
+            
+            hot_path* coldest = nullptr;
+            for(hot_path& hot : hottest_)
+            {
+                if(hot.Key == key)
+                {
+                    hot.Weighted = estimate;
+                    return;
+                }
+                if(coldest == nullptr || hot.Weighted < coldest->Weighted)
+                    coldest = &hot;
+            }
+            
+            if(hottest_.size() < topK_)
+                hottest_.push_back(hot_path{key, makePath(), estimate});
+            else if(coldest->Weighted < estimate)
+                *coldest = hot_path{key, makePath(), estimate};
+        }
+        
+        // Decayed number of recent accesses, over-estimated at worst.
+        double Score(std::string_view path) const
+        {
+            return Estimate(generation_table::HashPath(path)) / Weight(Now());
+        }
+        
+        // The hottest paths, hottest first.
+        std::vector<entry> Hottest() const
+        {
+            double weight = Weight(Now());
+            std::vector<entry> result;
+            for(const hot_path& hot : hottest_)
+                result.push_back(entry{hot.Path, hot.Weighted / weight});
+            std::sort(result.begin(), result.end(), [](const entry& a, const entry& b){ return a.Score > b.Score; });
+            return result;
+        }
+        
+        size_t Bytes() const
+        {
+            return counters_.capacity() * sizeof(double) + hottest_.capacity() * sizeof(hot_path);
+        }
+    };
+    
+    // Structure-of-arrays mirror of an event queue for consumers that scan pending events in
+    // bulk. Types, name hashes, interned name ids and timestamps each live in their own
+    // contiguous array so counting or searching touches only the column it needs.
+    class event_index
+    {
+    public:
+        using hash_type = uint64_t;
+        
+        static hash_type HashName(std::string_view name)
+        {
+            return std::hash<std::string_view>()(name);
+        }
+        
+    private:
+        bool enabled_ = false;
+        size_t base_ = 0; // queue position of the first indexed event
+        std::pmr::vector<uint8_t> types_;
+        std::pmr::vector<hash_type> hashes_;
+        std::pmr::vector<name_table::id_type> nameIds_;
+        std::pmr::vector<int64_t> timestamps_; // steady clock nanoseconds
+        size_t trimmed_ = 0; // leading entries already released
+        
+        size_t First(size_t from) const
+        {
+            return (from > base_ + trimmed_ ? from - base_ : trimmed_);
+        }
+        
+    public:
+        explicit event_index(std::pmr::memory_resource* resource) :
+            types_(resource),
+            hashes_(resource),
+            nameIds_(resource),
+            timestamps_(resource)
+        {}
+        
+        bool Enabled() const { return enabled_; }
+        size_t Begin() const { return base_ + trimmed_; }
+        size_t End() const { return base_ + types_.size(); }
+        
+        // Starts indexing at the given queue position, events queued before it are not indexed.
+        void Enable(size_t position)
+        {
+            if(enabled_)
+                return;
+            enabled_ = true;
+            base_ = position;
+        }
+        
+        size_t Bytes() const
+        {
+            return types_.capacity() * sizeof(uint8_t) + hashes_.capacity() * sizeof(hash_type) +
+                   nameIds_.capacity() * sizeof(name_table::id_type) + timestamps_.capacity() * sizeof(int64_t);
+        }
+        
+        void Append(watch::directory_event::type type, std::string_view name, name_table::id_type nameId, int64_t timestamp)
+        {
+            types_.push_back(static_cast<uint8_t>(type));
+            hashes_.push_back(HashName(name));
+            nameIds_.push_back(nameId);
+            timestamps_.push_back(timestamp);
+        }
+        
+        // Releases everything before position, storage is compacted once half of it is dead.
+        void TrimFront(size_t position)
+        {
+            if(position <= base_ + trimmed_)
+                return;
+            trimmed_ = std::min(position - base_, types_.size());
+            if(trimmed_ * 2 < types_.size())
+                return;
+            
+            types_.erase(types_.begin(), types_.begin() + trimmed_);
+            hashes_.erase(hashes_.begin(), hashes_.begin() + trimmed_);
+            nameIds_.erase(nameIds_.begin(), nameIds_.begin() + trimmed_);
+            timestamps_.erase(timestamps_.begin(), timestamps_.begin() + trimmed_);
+            base_ += trimmed_;
+            trimmed_ = 0;
+        }
+        
+        bool Any(size_t from, watch::directory_event::type type) const
+        {
+            size_t first = First(from);
+            if(first >= types_.size())
+                return false;
+            return std::memchr(types_.data() + first, static_cast<uint8_t>(type), types_.size() - first) != nullptr;
+        }
+        
+        size_t Count(size_t from, watch::directory_event::type type) const
+        {
+            const uint8_t wanted = static_cast<uint8_t>(type);
+            const uint8_t* types = types_.data();
+            size_t count = 0;
+            for(size_t i = First(from), end = types_.size(); i < end; i++)
+                count += (types[i] == wanted);
+            return count;
+        }
+        
+        // Queue position of the first event at or after from whose name hashes to hash, End() if none.
+        size_t Find(size_t from, hash_type hash) const
+        {
+            const hash_type* hashes = hashes_.data();
+            for(size_t i = First(from), end = hashes_.size(); i < end; i++)
+            {
+                if(hashes[i] == hash)
+                    return base_ + i;
+            }
+            return End();
+        }
+        
+        size_t Count(size_t from, name_table::id_type nameId) const
+        {
+            const name_table::id_type* ids = nameIds_.data();
+            size_t count = 0;
+            for(size_t i = First(from), end = nameIds_.size(); i < end; i++)
+                count += (ids[i] == nameId);
+            return count;
+        }
+        
+        watch::directory_event::type Type(size_t position) const
+        {
+            return static_cast<watch::directory_event::type>(types_[position - base_]);
+        }
+        
+        name_table::id_type NameId(size_t position) const
+        {
+            return nameIds_[position - base_];
+        }
+        
+        int64_t Timestamp(size_t position) const
+        {
+            return timestamps_[position - base_];
+        }
+    };
+
+#ifdef __unix__
+    // Helper thread warming the page cache for files consumers are about to read. Paths are
+    // queued by the pool while it parses events, so the advice is issued before the consumer
+    // sees the event. Readahead gives no completion signal, so the bytes in flight are bounded
+    // by advising at most MaxBytesPerSecond.
+    class prefetcher : public no_copy
+    {
+        watch::prefetch_options options_;
+        std::mutex mutex_;
+        std::condition_variable wake_;
+        std::deque<std::string> pending_;
+        std::unordered_set<std::string> queued_; // pending_ as a set, a burst of events on one file is advised once
+        bool stop_ = false;
+        std::atomic<size_t> issued_{0};
+        std::atomic<size_t> dropped_{0};
+        std::thread worker_;
+        
+        void Prefetch(const std::string& path, size_t& windowBytes, std::chrono::steady_clock::time_point& windowStart)
+        {
+            int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC | O_NOATIME);
+            if(fd == -1 && errno == EPERM)
+                fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if(fd == -1)
+                return;
+            
+            struct stat info;
+            if(fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0)
+            {
+                size_t bytes = std::min<size_t>(static_cast<size_t>(info.st_size), options_.MaxFileBytes);
+                
+                auto now = std::chrono::steady_clock::now();
+                if(now - windowStart >= std::chrono::seconds(1))
+                {
+                    windowStart = now;
+                    windowBytes = 0;
+                }
+                else if(windowBytes + bytes > options_.MaxBytesPerSecond)
+                {
+                    std::this_thread::sleep_until(windowStart + std::chrono::seconds(1));
+                    windowStart = std::chrono::steady_clock::now();
+                    windowBytes = 0;
+                }
+                
+                posix_fadvise(fd, 0, (off_t)bytes, POSIX_FADV_WILLNEED);
+#ifdef __linux__
+                readahead(fd, 0, bytes);
+#endif
+                windowBytes += bytes;
+                issued_ += bytes;
+            }
+            close(fd);
+        }
+        
+        void Run()
+        {
+            size_t windowBytes = 0;
+            auto windowStart = std::chrono::steady_clock::now();
+            
+            std::unique_lock<std::mutex> lock(mutex_);
+            while(true)
+            {
+                wake_.wait(lock, [this]{ return stop_ || !pending_.empty(); });
+                if(stop_)
+                    return;
+                
+                std::string path = std::move(pending_.front());
+                pending_.pop_front();
+                queued_.erase(path);
+                lock.unlock();
+                Prefetch(path, windowBytes, windowStart);
+                lock.lock();
+            }
+        }
+        
+    public:
+        explicit prefetcher(const watch::prefetch_options& options) :
+            options_(options),
+            worker_([this]{ Run(); })
+        {}
+        
+        ~prefetcher()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stop_ = true;
+            }
+            wake_.notify_one();
+            worker_.join();
+        }
+        
+        bool Wants(std::string_view path) const
+        {
+            return !options_.Filter || options_.Filter(path);
+        }
+        
+        void Submit(std::string path)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if(queued_.count(path) != 0)
+                    return;
+                if(pending_.size() >= options_.MaxPending)
+                {
+                    dropped_++;
+                    return;
+                }
+                queued_.insert(path);
+                pending_.push_back(std::move(path));
+            }
+            wake_.notify_one();
+        }
+        
+        // Bytes advised so far.
+        size_t Issued() const
+        {
+            return issued_.load();
+        }
+        
+        // Paths dropped because the helper was too far behind.
+        size_t Dropped() const
+        {
+            return dropped_.load();
+        }
+    };
+    
+    class inotify_watch_pool : public no_copy
+    {
+    public:
+        using id_type = int;
+
+    private:
+        // Names are interned, so a queued event is just its type and name id.
+        struct queued_event
+        {
+            watch::directory_event::type Type;
+            name_table::id_type NameId;
+        };
+        
+        using event_queue = segmented_queue<queued_event>;
+        
+        // Events of one name held back while an atomic save may be in progress.
+        struct held_event
+        {
+            constexpr static uint8_t MaxTypes = 4;
+            
+            name_table::id_type NameId;
+            uint32_t Cookie = 0; // rename cookie once the file was moved away
+            int64_t Deadline;    // steady clock nanoseconds
+            uint8_t Count = 0;
+            watch::directory_event::type Types[MaxTypes];
+        };
+        
+        struct watch_state
+        {
+            event_queue Events;
+            event_index Index;
+            std::pmr::vector<held_event> Held;
+            std::pmr::multiset<size_t> Readers; // ticket of every watch reading this queue
+            std::pmr::unordered_map<name_table::id_type, size_t> Newest; // position of the last queued event per name, kept while coalescing
+            std::pmr::string Path;
+            generation_table::path_hash PathHash;
+            watch::memory_usage Usage;
+            watch::memory_budget Budget;
+            id_type Handle = -1;
+            bool Overflowed = false;
+            size_t Marker = 0; // position of the last budget marker while Overflowed
+            bool Dirty = false; // queued something since the last TakeDirty
+            
+            watch_state(chunk_arena* arena, std::pmr::memory_resource* resource) :
+                Events(arena, resource),
+                Index(resource),
+                Held(resource),
+                Readers(resource),
+                Newest(resource),
+                Path(resource)
+            {}
+        };
+        
+        constexpr static size_t EventBufferSize = 4096;
+        constexpr static size_t MaxEventBufferSize = 256 * 1024;
+        constexpr static size_t MaxEventSize = sizeof(inotify_event) + NAME_MAX + 1;
+
+        int handleInotify_;
+        
+        std::pmr::memory_resource* resource_;
+        chunk_arena arena_;
+        name_table names_;
+        std::pmr::unordered_map<id_type, watch_state> events_;
+        
+        std::unique_ptr<generation_table> generations_;
+        std::unique_ptr<latest_table> latest_;
+        uint64_t sequence_ = 0; // events recorded in latest_
+        std::unique_ptr<access_heatmap> heatmap_;
+        std::unique_ptr<prefetcher> prefetcher_;
+        std::pmr::vector<id_type> dirty_;
+        
+        watch::memory_usage usage_;
+        watch::memory_budget budget_;
+        
+        int64_t atomicSaveWindow_ = 0; // nanoseconds, 0 disables atomic save detection
+        uint32_t rescanGeneration_ = 0; // losses so far, queued markers keep theirs in place of a name id
+        size_t heldCount_ = 0;
+        
+        size_t eventBufferBytes_ = EventBufferSize;
+        unsigned char* eventBuffer_;
+        watch::pool_config config_;
+        
+        constexpr static uint32_t DeadFlags = (IN_IGNORED | IN_Q_OVERFLOW | IN_UNMOUNT);
+        constexpr static uint32_t FileCreatedFlags = (IN_CREATE | IN_MOVED_TO);
+        constexpr static uint32_t FileDeletedFlags= (IN_MOVED_FROM| IN_DELETE);
+        constexpr static uint32_t FileModifiedFlags= (IN_MODIFY | IN_CLOSE_WRITE);
+        constexpr static uint32_t AccessFlags = (IN_OPEN | IN_ACCESS);
+        
+        uint32_t TranslateToFlags(watch::directory_event::type event)
+        {
+            using ev = watch::directory_event::type;
+            if(event == ev::file_created) return FileCreatedFlags;
+            if(event == ev::file_deleted) return FileDeletedFlags;
+            if(event == ev::file_modified) return FileModifiedFlags;
+            return 0;
+        }
+        
+        
+        // Heap bytes owned by a string, zero while it fits in the small string buffer.
+        static size_t HeapBytes(const std::pmr::string& str)
+        {
+            static const size_t inlineCapacity = std::pmr::string().capacity();
+            return str.capacity() > inlineCapacity ? str.capacity() + 1 : 0;
+        }
+        
+        static bool OverBudget(const watch::memory_budget& budget, const watch::memory_usage& usage, size_t extra)
+        {
+            return budget.Bytes != 0 && usage.EventBytes + extra > budget.Bytes;
+        }
+        
+        bool Coalescing(const watch_state& state) const
+        {
+            const watch::memory_budget& budget = state.Budget.Bytes != 0 ? state.Budget : budget_;
+            return budget.Bytes != 0 && budget.Policy == watch::budget_policy::coalesce;
+        }
+        
+        void AddUsage(watch_state& state, size_t eventBytes, size_t nameBytes, size_t pathBytes)
+        {
+            state.Usage.EventBytes += eventBytes;
+            state.Usage.NameBytes += nameBytes;
+            state.Usage.PathBytes += pathBytes;
+            usage_.EventBytes += eventBytes;
+            usage_.NameBytes += nameBytes;
+            usage_.PathBytes += pathBytes;
+        }
+        
+        void RemoveUsage(watch_state& state, size_t eventBytes, size_t nameBytes, size_t pathBytes)
+        {
+            state.Usage.EventBytes -= eventBytes;
+            state.Usage.NameBytes -= nameBytes;
+            state.Usage.PathBytes -= pathBytes;
+            usage_.EventBytes -= eventBytes;
+            usage_.NameBytes -= nameBytes;
+            usage_.PathBytes -= pathBytes;
+        }
+        
+        static int64_t Now()
+        {
+            auto now = std::chrono::steady_clock::now().time_since_epoch();
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(now).count();
+        }
+        
+        void Push(watch_state& state, watch::directory_event::type type, name_table::id_type nameId)
+        {
+            if(prefetcher_ && nameId != name_table::NoName &&
+               (type == watch::directory_event::file_created || type == watch::directory_event::file_modified ||
+                type == watch::directory_event::file_replaced))
+            {
+                std::string path(state.Path);
+                path.append("/").append(names_.NameOf(nameId));
+                if(prefetcher_->Wants(path))
+                    prefetcher_->Submit(std::move(path));
+            }
+            
+            if(!state.Dirty)
+            {
+                state.Dirty = true;
+                dirty_.push_back(state.Handle);
+            }
+            
+            if(type != watch::directory_event::events_overflowed)
+            {
+                names_.Acquire(nameId);
+                if(Coalescing(state) && nameId != name_table::NoName)
+                    state.Newest[nameId] = state.Events.End();
+            }
+            size_t chunks = state.Events.Chunks();
+            state.Events.EmplaceBack(queued_event{type, nameId});
+            AddUsage(state, (state.Events.Chunks() - chunks) * chunk_arena::ChunkBytes, 0, 0);
+            
+            if(state.Index.Enabled())
+            {
+                if(type == watch::directory_event::events_overflowed)
+                    nameId = name_table::NoName;
+                size_t indexBytes = state.Index.Bytes();
+                state.Index.Append(type, names_.NameOf(nameId), nameId, Now());
+                AddUsage(state, state.Index.Bytes() - indexBytes, 0, 0);
+            }
+        }
+        
+        // Drops the events before position and their name references.
+        void TrimEvents(watch_state& state, size_t position)
+        {
+            size_t current = state.Events.Begin();
+            state.Events.TrimFront(position, [&](const queued_event& queued)
+            {
+                if(queued.Type != watch::directory_event::events_overflowed)
+                {
+                    auto newest = state.Newest.find(queued.NameId);
+                    if(newest != state.Newest.end() && newest->second == current)
+                        state.Newest.erase(newest);
+                    names_.Release(queued.NameId);
+                }
+                current++;
+            });
+        }
+        
+        // Drops every event all readers of the queue are past.
+        void Trim(watch_state& state)
+        {
+            if(state.Readers.empty())
+                return;
+            
+            size_t chunks = state.Events.Chunks();
+            TrimEvents(state, *state.Readers.begin());
+            RemoveUsage(state, (chunks - state.Events.Chunks()) * chunk_arena::ChunkBytes, 0, 0);
+            
+            if(state.Index.Enabled())
+            {
+                size_t indexBytes = state.Index.Bytes();
+                state.Index.TrimFront(*state.Readers.begin());
+                RemoveUsage(state, indexBytes - state.Index.Bytes(), 0, 0);
+            }
+        }
+        
+        void Remember(watch_state& state, watch::directory_event::type type, name_table::id_type nameId)
+        {
+            generation_table::path_hash hash = state.PathHash;
+            if(nameId != name_table::NoName)
+                hash.Separator().Append(names_.NameOf(nameId));
+            latest_->Store(hash.Key(), type, ++sequence_, Now());
+        }
+        
+        void Append(watch_state& state, watch::directory_event::type type, name_table::id_type nameId)
+        {
+            PROFILE(append)
+            if(latest_)
+                Remember(state, type, nameId);
+            
+            size_t cost = sizeof(queued_event);
+            
+            bool overBudget = OverBudget(state.Budget, state.Usage, cost) || OverBudget(budget_, usage_, cost);
+            if(!overBudget)
+                state.Overflowed = false;
+            else
+            {
+                watch::budget_policy policy = state.Budget.Bytes != 0 ? state.Budget.Policy : budget_.Policy;
+                if(policy == watch::budget_policy::coalesce)
+                {
+                    // dropping is exact only if nothing newer for the name is queued and every
+                    // reader will still see the queued one
+                    auto newest = state.Newest.find(nameId);
+                    if(newest != state.Newest.end() && state.Events[newest->second].Type == type &&
+                       !state.Readers.empty() && *state.Readers.rbegin() <= newest->second)
+                        return;
+                }
+                
+                // one marker covers the gap until a reader gets past it
+                if(state.Overflowed && !state.Readers.empty() && *state.Readers.rbegin() <= state.Marker)
+                    return;
+                
+                // the marker itself is always queued so the consumer learns about the gap
+                state.Overflowed = true;
+                state.Marker = state.Events.End();
+                type = watch::directory_event::events_overflowed;
+                nameId = NextRescanGeneration();
+            }
+            
+            Push(state, type, nameId);
+        }
+        
+        held_event* FindHeld(watch_state& state, name_table::id_type nameId)
+        {
+            for(held_event& held : state.Held)
+            {
+                if(held.NameId == nameId)
+                    return &held;
+            }
+            return nullptr;
+        }
+        
+        void EraseHeld(watch_state& state, held_event* held)
+        {
+            names_.Release(held->NameId);
+            state.Held.erase(state.Held.begin() + (held - state.Held.data()));
+            heldCount_--;
+        }
+        
+        void Hold(watch_state& state, name_table::id_type nameId, watch::directory_event::type type)
+        {
+            held_event held;
+            held.NameId = nameId;
+            held.Deadline = Now() + atomicSaveWindow_;
+            held.Types[held.Count++] = type;
+            names_.Acquire(nameId);
+            state.Held.push_back(held);
+            heldCount_++;
+        }
+        
+        void Release(watch_state& state, held_event* held)
+        {
+            for(uint8_t i = 0; i < held->Count; i++)
+                Append(state, held->Types[i], held->NameId);
+            if(held->Cookie != 0) // renamed to somewhere outside this directory
+                Append(state, watch::directory_event::file_deleted, held->NameId);
+            EraseHeld(state, held);
+        }
+        
+        // Queues held events whose correlation window has passed, or all of them when force is set.
+        void ReleaseExpired(bool force)
+        {
+            if(heldCount_ == 0)
+                return;
+            
+            int64_t now = Now();
+            for(auto& entry : events_)
+            {
+                auto& held = entry.second.Held;
+                while(!held.empty() && (force || held.front().Deadline <= now))
+                    Release(entry.second, &held.front());
+            }
+        }
+        
+        // Recognizes saves that write a temporary file and rename it over the target. Events of a
+        // freshly created file, and deletes happening while such a file is in flight, are held
+        // for the correlation window. When a held file is renamed onto another name its events
+        // are dropped and the target gets a single file_replaced. Returns true if the event was
+        // consumed. Held events are queued late, so they may end up behind newer events for
+        // other names, the order per name is kept.
+        bool Correlate(watch_state& state, const inotify_event& event, watch::directory_event::type type,
+                       name_table::id_type nameId)
+        {
+            held_event* held = FindHeld(state, nameId);
+            
+            if((event.mask & IN_MOVED_TO) != 0)
+            {
+                for(held_event& source : state.Held)
+                {
+                    if(source.Cookie == 0 || source.Cookie != event.cookie)
+                        continue;
+                    
+                    EraseHeld(state, &source);
+                    held = FindHeld(state, nameId);
+                    if(held != nullptr) // whatever happened to the old target is superseded
+                        EraseHeld(state, held);
+                    Append(state, watch::directory_event::file_replaced, nameId);
+                    return true;
+                }
+                if(held != nullptr)
+                    Release(state, held);
+                return false;
+            }
+            
+            if((event.mask & IN_MOVED_FROM) != 0)
+            {
+                if(held == nullptr || held->Cookie != 0)
+                    return false;
+                held->Cookie = event.cookie;
+                return true;
+            }
+            
+            if(held != nullptr)
+            {
+                auto last = held->Types[held->Count - 1];
+                bool recreated = (last == watch::directory_event::file_deleted && type == watch::directory_event::file_created);
+                if(held->Cookie == 0 && recreated)
+                {
+                    held->Types[held->Count - 1] = watch::directory_event::file_replaced;
+                    return true;
+                }
+                if(held->Cookie == 0 && type == watch::directory_event::file_modified && held->Count < held_event::MaxTypes)
+                {
+                    if(last != type)
+                        held->Types[held->Count++] = type;
+                    return true;
+                }
+                Release(state, held);
+            }
+            
+            if((event.mask & IN_CREATE) != 0 || (type == watch::directory_event::file_deleted && !state.Held.empty()))
+            {
+                Hold(state, nameId, type);
+                return true;
+            }
+            return false;
+        }
+        
+        static uint64_t ReadLimit(const char* path)
+        {
+            int fd = open(path, O_RDONLY | O_CLOEXEC);
+            if(fd == -1)
+                return 0;
+            char text[32] = {};
+            ssize_t len = read(fd, text, sizeof(text) - 1);
+            close(fd);
+            return len > 0 ? std::strtoull(text, nullptr, 10) : 0;
+        }
+        
+        // The kernel queue overflowed, any watch may have lost events.
+        void LostAll()
+        {
+            uint32_t generation = NextRescanGeneration();
+            for(auto& entry : events_)
+            {
+                if(generations_)
+                {
+                    generations_->Bump(entry.second.PathHash.Key());
+                    generations_->Bump(generation_table::path_hash(entry.second.PathHash).Loss().Key());
+                }
+                if(latest_)
+                    Remember(entry.second, watch::directory_event::events_overflowed, name_table::NoName);
+                Push(entry.second, watch::directory_event::events_overflowed, generation);
+            }
+        }
+        
+        void ParseEvent(inotify_event& event)
+        {
+            PROFILE(parse)
+            LOG("Parse " << event.mask);
+            
+            if(event.wd == -1)
+            {
+                if((event.mask & IN_Q_OVERFLOW) != 0)
+                    LostAll();
+                return;
+            }
+            
+            auto iter = events_.find(event.wd);
+            if(iter == events_.end())
+                return; // late event for a watch that has no readers left
+            watch_state& state = iter->second;
+            
+            // accesses only feed the heatmap, they are not changes
+            if((event.mask & AccessFlags) != 0)
+            {
+                if(heatmap_)
+                {
+                    generation_table::path_hash hash = state.PathHash;
+                    if(event.len != 0 && event.name[0] != 0)
+                        hash.Separator().Append(event.name);
+                    heatmap_->Record(hash.Key(), [&]
+                    {
+                        std::string path(state.Path);
+                        if(event.len != 0 && event.name[0] != 0)
+                            path.append("/").append(event.name);
+                        return path;
+                    });
+                }
+                if((event.mask & ~(AccessFlags | IN_ISDIR)) == 0)
+                    return;
+            }
+            
+            if(generations_)
+            {
+                generations_->Bump(state.PathHash.Key());
+                if(event.len != 0 && event.name[0] != 0)
+                    generations_->Bump(generation_table::path_hash(state.PathHash).Separator().Append(event.name).Key());
+            }
+   
+            if((event.mask & DeadFlags) != 0)
+            {
+                // dead, an unmount takes the files with it without an event each
+                if(generations_)
+                    generations_->Bump(generation_table::path_hash(state.PathHash).Loss().Key());
+                while(!state.Held.empty())
+                    Release(state, &state.Held.front());
+                if(latest_)
+                    Remember(state, watch::directory_event::watch_directory_destroyed, name_table::NoName);
+                Push(state, watch::directory_event::watch_directory_destroyed, name_table::NoName);
+            }
+            else
+            {
+                watch::directory_event::type type;
+                if((event.mask & FileCreatedFlags) != 0)
+                    type = watch::directory_event::file_created;
+                
+                else if((event.mask & FileDeletedFlags) != 0)
+                    type = watch::directory_event::file_deleted;
+                
+                else if((event.mask & FileModifiedFlags) != 0)
+                    type = watch::directory_event::file_modified;
+                
+                else
+                    return;
+                
+                // queued and held events take references of their own
+                name_table::id_type nameId = names_.Intern(event.name);
+                if(atomicSaveWindow_ == 0 || !Correlate(state, event, type, nameId))
+                    Append(state, type, nameId);
+                names_.Release(nameId);
+            }
+        }
+    
+    public:
+
+        // Huge pages pay off for pools that queue megabytes of events, but every pool would
+        // then pin a whole 2 MiB page for its first chunk, so they are opt-in.
+        explicit inotify_watch_pool(watch::huge_pages hugePages = watch::huge_pages::none) :
+                handleInotify_(inotify_init1(IN_NONBLOCK)),
+                resource_(std::pmr::get_default_resource()),
+                arena_(hugePages),
+                names_(&arena_, resource_),
+                events_(resource_),
+                dirty_(resource_),
+                eventBuffer_((unsigned char*)resource_->allocate(EventBufferSize))
+        {
+        }
+        
+        // The chunk arena, interned names, per-watch state and the storage of the generation and
+        // latest event tables come from resource. The access heatmap, the prefetcher, the small
+        // objects owning the tables and the Name of a polled event use the global heap.
+        explicit inotify_watch_pool(std::pmr::memory_resource* resource) :
+                handleInotify_(inotify_init1(IN_NONBLOCK)),
+                resource_(resource),
+                arena_(resource),
+                names_(&arena_, resource_),
+                events_(resource_),
+                dirty_(resource_),
+                eventBuffer_((unsigned char*)resource_->allocate(EventBufferSize))
+        {
+        }
+        
+        ~inotify_watch_pool()
+        {
+            resource_->deallocate(eventBuffer_, eventBufferBytes_);
+        }
+    
+        struct create_result
+        {
+            int Error = 0;
+            id_type Handle;
+            size_t Ticket;
+        };
+        
+        create_result Create(const char* file)
+        {
+            // a directory watched before keeps its handle, IN_MASK_ADD keeps the access events
+            // TrackAccess may have added to it
+            uint32_t flags =  FileCreatedFlags | FileDeletedFlags | FileModifiedFlags | IN_MASK_ADD;
+            
+            id_type handle = inotify_add_watch(handleInotify_, file, flags);
+            
+            create_result result;
+            result.Error = (handle == -1 ? errno : 0);
+            result.Handle = handle;
+            result.Ticket = 0;
+            if(handle != -1)
+            {
+                watch_state& state = events_.try_emplace(handle, &arena_, resource_).first->second;
+                state.Handle = handle;
+                if(state.Path.empty())
+                {
+                    state.Path = file;
+                    state.PathHash.Append(state.Path);
+                    AddUsage(state, 0, 0, HeapBytes(state.Path));
+                }
+                result.Ticket = state.Events.End();
+                state.Readers.insert(result.Ticket);
+            }
+            return result;
+        }
+        
+        // Unregisters the reader holding ticket, the inotify watch is removed with its last reader.
+        void Destroy(id_type id, size_t ticket)
+        {
+            if(id == -1)
+                return;
+            
+            auto iter = events_.find(id);
+            if(iter == events_.end())
+                return;
+            
+            watch_state& state = iter->second;
+            auto reader = state.Readers.find(ticket);
+            if(reader != state.Readers.end())
+                state.Readers.erase(reader);
+            
+            if(!state.Readers.empty())
+            {
+                Trim(state);
+                return;
+            }
+            
+            inotify_rm_watch(handleInotify_, id);
+            while(!state.Held.empty())
+                EraseHeld(state, &state.Held.back());
+            TrimEvents(state, state.Events.End());
+            usage_.EventBytes -= state.Usage.EventBytes;
+            usage_.NameBytes -= state.Usage.NameBytes;
+            usage_.PathBytes -= state.Usage.PathBytes;
+            events_.erase(iter);
+        }
+        
+        void Update()
+        {
+            ssize_t len;
+            {
+                PROFILE(read)
+                len = read(handleInotify_, eventBuffer_, eventBufferBytes_);
+            }
+            ssize_t offset = 0;
+            
+            if(len == -1)
+            {
+                ReleaseExpired(false);
+                return;
+            }
+      
+            while(len > offset)
+            {
+                inotify_event* ev = (inotify_event*)(offset + eventBuffer_);
+                ParseEvent(*ev);
+                offset += sizeof(ev->mask) + sizeof(ev->wd) + sizeof(ev->cookie) + sizeof(ev->len) + ev->len;
+            }
+            ReleaseExpired(false);
+        }
+        
+        // Parses everything the kernel has queued so far without blocking, releasing held
+        // events whose window passed even when nothing new arrived.
+        void Drain()
+        {
+            pollfd readable = {handleInotify_, POLLIN, 0};
+            do
+                Update();
+            while(poll(&readable, 1, 0) == 1);
+        }
+        
+        // Collapses write-temp-and-rename saves into one file_replaced event for the target, the
+        // events of newly created files are delayed by up to window. Zero turns detection off.
+        void SetAtomicSaveWindow(std::chrono::milliseconds window)
+        {
+            atomicSaveWindow_ = std::chrono::duration_cast<std::chrono::nanoseconds>(window).count();
+            if(atomicSaveWindow_ == 0)
+                ReleaseExpired(true);
+        }
+        
+        // Milliseconds until the earliest held event is due, rounded up, -1 while nothing is
+        // held. Pass it as the timeout of poll() on Descriptor and call Update when it expires.
+        int NextReleaseTimeout() const
+        {
+            if(heldCount_ == 0)
+                return -1;
+            
+            int64_t next = INT64_MAX;
+            for(auto& entry : events_)
+            {
+                if(!entry.second.Held.empty())
+                    next = std::min(next, entry.second.Held.front().Deadline);
+            }
+            if(next == INT64_MAX)
+                return -1;
+            int64_t remaining = next - Now();
+            if(remaining <= 0)
+                return 0;
+            return static_cast<int>(std::min<int64_t>((remaining + 999999) / 1000000, INT_MAX));
+        }
+        
+        // Copies the event at ticket and advances it, returns false when the reader is caught up.
+        bool Poll(id_type watch, size_t& ticket, watch::directory_event& event)
+        {
+            PROFILE(dispatch)
+            auto iter = events_.find(watch);
+            if(iter == events_.end())
+                return false;
+            
+            watch_state& state = iter->second;
+            if(ticket >= state.Events.End())
+                return false;
+            
+            const queued_event& queued = state.Events[ticket];
+            event.Type = queued.Type;
+            event.Scope = watch::rescan_scope::directory;
+            if(queued.Type == watch::directory_event::events_overflowed)
+            {
+                event.NameId = name_table::NoName;
+                event.Name.clear();
+                event.Generation = queued.NameId;
+            }
+            else
+            {
+                event.NameId = queued.NameId;
+                event.Name.assign(names_.NameOf(queued.NameId));
+                event.Generation = 0;
+            }
+            
+            auto reader = state.Readers.find(ticket);
+            if(reader != state.Readers.end())
+                state.Readers.erase(reader);
+            state.Readers.insert(++ticket);
+            
+            Trim(state);
+            return true;
+        }
+        
+        // Appends every watch that queued events since the previous call, so a consumer of many
+        // watches only polls the ones with something new. Meant for a single such consumer per pool.
+        template<typename Container>
+        void TakeDirty(Container& out)
+        {
+            for(id_type handle : dirty_)
+            {
+                auto iter = events_.find(handle);
+                if(iter == events_.end())
+                    continue;
+                iter->second.Dirty = false;
+                out.push_back(handle);
+            }
+            dirty_.clear();
+        }
+        
+        // Queued events for a watch, positions below the lowest reader ticket are already released.
+        const event_queue* GetEvents(id_type watch) const
+        {
+            auto iter = events_.find(watch);
+            return iter == events_.end() ? nullptr : &iter->second.Events;
+        }
+        
+        // Starts keeping a generation per watched directory and per file seen in one, bumped by
+        // every event Update parses, dropped or coalesced ones included. Must be called before
+        // other threads read generations.
+        void TrackGenerations(size_t buckets = 4096)
+        {
+            if(generations_)
+                return;
+            generations_.reset(new generation_table(buckets, resource_));
+            usage_.TableBytes += generations_->Bytes();
+        }
+        
+        // Like TrackGenerations, but the table lives in a memfd that other processes can map with
+        // generation_table::Attach. Returns the descriptor to hand to them, -1 with errno set
+        // when the memfd could not be created. Replaces any private table, which is freed, so
+        // like TrackGenerations it must be called before other threads use Generation or
+        // Generations.
+        int ShareGenerations(size_t buckets = 4096)
+        {
+            if(generations_ && generations_->Descriptor() != -1)
+                return generations_->Descriptor();
+            
+            int error = 0;
+            auto shared = generation_table::CreateShared(buckets, &error);
+            if(!shared)
+            {
+                errno = error;
+                return -1;
+            }
+            if(generations_)
+                usage_.TableBytes -= generations_->Bytes();
+            generations_ = std::move(shared);
+            usage_.TableBytes += generations_->Bytes();
+            return generations_->Descriptor();
+        }
+        
+        const generation_table* Generations() const
+        {
+            return generations_.get();
+        }
+        
+        // Starts recording the last event of every path, the table keeps bucketCount times
+        // latest_table::BucketSlots paths. Events dropped or coalesced for the memory budget are
+        // recorded too. Must be called before other threads query it.
+        void TrackLatest(size_t buckets = 4096)
+        {
+            if(latest_)
+                return;
+            latest_.reset(new latest_table(buckets, resource_));
+            usage_.TableBytes += latest_->Bytes();
+        }
+        
+        // Last event for a watched directory or a file in one, safe to call from any thread.
+        // When the directory lost its events or was destroyed after the file's last event, that
+        // is returned instead with the directory's sequence, the file may have changed unseen.
+        // Returns false when nothing was recorded for path or its record was evicted.
+        bool Latest(std::string_view path, watch::path_state& state) const
+        {
+            if(!latest_)
+                return false;
+            
+            bool found = latest_->Load(path, state);
+            watch::path_state directory;
+            std::string_view parent = generation_table::ParentOf(path);
+            if(!parent.empty() && latest_->Load(parent, directory) && (!found || directory.Sequence > state.Sequence))
+            {
+                state = directory;
+                return true;
+            }
+            return found;
+        }
+        
+        // Adds open and access events of a watched directory to the pool's heatmap. The options
+        // size the heatmap when it is first created. Returns errno, zero on success; the
+        // subscription is lost if the directory is watched anew under a different handle.
+        int TrackAccess(id_type watch, const watch::heatmap_options& options = {})
+        {
+            auto iter = events_.find(watch);
+            if(iter == events_.end())
+                return EINVAL;
+            
+            if(!heatmap_)
+            {
+                heatmap_.reset(new access_heatmap(options));
+                usage_.TableBytes += heatmap_->Bytes();
+            }
+            
+            if(inotify_add_watch(handleInotify_, iter->second.Path.c_str(), AccessFlags | IN_MASK_ADD) == -1)
+                return errno;
+            return 0;
+        }
+        
+        const access_heatmap* Heatmap() const
+        {
+            return heatmap_.get();
+        }
+        
+        // Starts a helper thread that reads ahead files named by created, modified and replaced
+        // events before they are queued for consumers.
+        void EnablePrefetch(const watch::prefetch_options& options = {})
+        {
+            prefetcher_.reset(new prefetcher(options));
+        }
+        
+        void DisablePrefetch()
+        {
+            prefetcher_.reset();
+        }
+        
+        const prefetcher* Prefetcher() const
+        {
+            return prefetcher_.get();
+        }
+        
+        // Generation of a watched directory or a file in one, safe to call from any thread.
+        // Cached data derived from the path is still current while this returns the same value,
+        // a kernel queue overflow changes it for every file of every watched directory.
+        // generation_table::Unavailable never counts as the same value.
+        uint64_t Generation(std::string_view path) const
+        {
+            return generations_ ? generations_->Load(path) : 0;
+        }
+        
+        static watch::inotify_limits ReadLimits()
+        {
+            watch::inotify_limits limits;
+            limits.MaxUserWatches = ReadLimit("/proc/sys/fs/inotify/max_user_watches");
+            limits.MaxUserInstances = ReadLimit("/proc/sys/fs/inotify/max_user_instances");
+            limits.MaxQueuedEvents = ReadLimit("/proc/sys/fs/inotify/max_queued_events");
+            return limits;
+        }
+        
+        // Sizes the pool for about expectedWatches directories from the kernel's limits. The
+        // drain buffer grows so one Update can take a good part of a busy kernel queue.
+        // BudgetBytes suggests a pool budget holding several kernel queues worth of events, it
+        // is left to the caller to apply, and Shards how many pools to spread the watches over,
+        // each with its own kernel queue. Call before events arrive.
+        watch::pool_config AutoTune(size_t expectedWatches)
+        {
+            constexpr size_t AverageEventBytes = sizeof(inotify_event) + 16;
+            constexpr size_t EventsPerWatch = 16;    // burst one read should take per watch
+            constexpr size_t QueuesHeld = 8;         // kernel queues worth of events the pool holds
+            constexpr size_t WatchesPerQueue = 8;    // a kernel queue per max_queued_events / this watches
+            constexpr size_t InstancesShared = 4;    // leave most instances to other processes
+            
+            watch::pool_config config;
+            config.Limits = ReadLimits();
+            config.ExpectedWatches = expectedWatches;
+            
+            size_t queued = config.Limits.MaxQueuedEvents != 0 ? (size_t)config.Limits.MaxQueuedEvents : 16384;
+            size_t perRead = std::min(queued, std::max<size_t>(64, expectedWatches * EventsPerWatch));
+            size_t bufferBytes = EventBufferSize;
+            while(bufferBytes < perRead * AverageEventBytes && bufferBytes < MaxEventBufferSize)
+                bufferBytes *= 2;
+            if(bufferBytes != eventBufferBytes_)
+            {
+                resource_->deallocate(eventBuffer_, eventBufferBytes_);
+                eventBuffer_ = (unsigned char*)resource_->allocate(bufferBytes);
+                eventBufferBytes_ = bufferBytes;
+            }
+            config.DrainBufferBytes = eventBufferBytes_;
+            
+            // every watch also fills a chunk of its own before the shared queue size matters
+            config.QueueEvents = queued * QueuesHeld;
+            config.BudgetBytes = config.QueueEvents * sizeof(queued_event) +
+                                 std::max<size_t>(1, expectedWatches) * chunk_arena::ChunkBytes;
+            
+            size_t perShard = std::max<size_t>(1, queued / WatchesPerQueue);
+            size_t instances = std::max<size_t>(1, config.Limits.MaxUserInstances / InstancesShared);
+            size_t cores = std::max(1u, std::thread::hardware_concurrency());
+            size_t shards = (expectedWatches + perShard - 1) / perShard;
+            config.Shards = (unsigned)std::max<size_t>(1, std::min({shards, instances, cores}));
+            config.WatchesFit = config.Limits.MaxUserWatches == 0 || expectedWatches <= config.Limits.MaxUserWatches;
+            
+            LOG("AutoTune watches " << expectedWatches << " buffer " << config.DrainBufferBytes << " queue "
+                << config.QueueEvents << " budget " << config.BudgetBytes << " shards " << config.Shards);
+            config_ = config;
+            return config;
+        }
+        
+        // The configuration chosen by the last AutoTune, default values if it was never called.
+        const watch::pool_config& Config() const
+        {
+            return config_;
+        }
+        
+        // Generation of the most recent loss, zero while no events were lost.
+        uint32_t RescanGeneration() const
+        {
+            return rescanGeneration_;
+        }
+        
+        // Starts a new loss generation, for watchers that find out about a loss by themselves.
+        uint32_t NextRescanGeneration()
+        {
+            return ++rescanGeneration_;
+        }
+        
+        // The inotify descriptor, readable whenever Update has something to parse. It does not
+        // become readable when held atomic-save events fall due; callers blocking on it have to
+        // wake up after NextReleaseTimeout as well, or those events stay held until the next
+        // unrelated event arrives.
+        int Descriptor() const
+        {
+            return handleInotify_;
+        }
+        
+        // Name ids are shared by every watch of the pool and may be looked up from any thread.
+        // An id is only bound to its name while a queued event or a pin refers to it; once the
+        // last one is gone the id is reused for another name. Key longer lived maps by name, or
+        // pin the names first.
+        const name_table& Names() const
+        {
+            return names_;
+        }
+        
+        // Interns name and keeps its id from being reused until UnpinName, for watchers that
+        // match events by id.
+        name_table::id_type PinName(std::string_view name)
+        {
+            return names_.Intern(name);
+        }
+        
+        void UnpinName(name_table::id_type id)
+        {
+            names_.Release(id);
+        }
+        
+        size_t ReservedBytes() const
+        {
+            return arena_.ReservedBytes();
+        }
+        
+        // Keeps a structure-of-arrays index of the watch's events from now on.
+        void EnableIndex(id_type watch)
+        {
+            auto iter = events_.find(watch);
+            if(iter != events_.end())
+                iter->second.Index.Enable(iter->second.Events.End());
+        }
+        
+        const event_index* GetIndex(id_type watch) const
+        {
+            auto iter = events_.find(watch);
+            if(iter == events_.end() || !iter->second.Index.Enabled())
+                return nullptr;
+            return &iter->second.Index;
+        }
+        
+        size_t ExplicitHugeBytes() const
+        {
+            return arena_.ExplicitHugeBytes();
+        }
+        
+        // Budget applied to the sum of all watches, checked in addition to the per-watch budget.
+        void SetBudget(const watch::memory_budget& budget)
+        {
+            budget_ = budget;
+            for(auto& entry : events_)
+                entry.second.Newest.clear(); // may be stale if coalescing was off for a while
+        }
+        
+        void SetBudget(id_type watch, const watch::memory_budget& budget)
+        {
+            auto iter = events_.find(watch);
+            if(iter == events_.end())
+                return;
+            iter->second.Budget = budget;
+            iter->second.Newest.clear();
+        }
+        
+        // NameBytes is only reported here, the name table is shared by every watch.
+        watch::memory_usage Usage() const
+        {
+            watch::memory_usage usage = usage_;
+            usage.NameBytes = names_.Bytes();
+            return usage;
+        }
+        
+        watch::memory_usage Usage(id_type watch) const
+        {
+            auto iter = events_.find(watch);
+            return iter == events_.end() ? watch::memory_usage() : iter->second.Usage;
+        }
+    };
+#endif
+}
+
+namespace watch
+{
+#if __unix__
+    using global_watch_pool_type = watch_impl::inotify_watch_pool;
+#endif
+    
+    using directory = generic_directory_watch<global_watch_pool_type>;
+    using file = generic_file_watcher<directory>;
+    
+    // Histogram of a stage since the last ResetProfile, empty unless compiled with WATCH_PROFILE.
+    inline profile_histogram Profile(profile_stage stage)
+    {
+        profile_histogram histogram;
+#ifdef WATCH_PROFILE
+        const auto& counters = watch_impl::profile_data()[(size_t)stage];
+        histogram.Count = counters.Count.load(std::memory_order_relaxed);
+        histogram.Total = counters.Total.load(std::memory_order_relaxed);
+        for(size_t i = 0; i < 64; i++)
+            histogram.Buckets[i] = counters.Buckets[i].load(std::memory_order_relaxed);
+#else
+        (void)stage;
+#endif
+        return histogram;
+    }
+    
+    inline void ResetProfile()
+    {
+#ifdef WATCH_PROFILE
+        for(size_t stage = 0; stage < ProfileStages; stage++)
+        {
+            auto& counters = watch_impl::profile_data()[stage];
+            counters.Count.store(0, std::memory_order_relaxed);
+            counters.Total.store(0, std::memory_order_relaxed);
+            for(auto& bucket : counters.Buckets)
+                bucket.store(0, std::memory_order_relaxed);
+        }
+#endif
+    }
 }
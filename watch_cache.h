@@ -0,0 +1,220 @@
+#pragma once
+
+#include "watch.h"
+
+#include <list>
+#include <memory>
+
+extern "C"
+{
+#include "fcntl.h"
+#include "sys/stat.h"
+#include "unistd.h"
+}
+
+namespace watch
+{
+    // Read-through cache of small file contents keyed by path. Each directory holding a cached
+    // file gets one watch, an entry is dropped as soon as Refresh sees an event for its file and
+    // the least recently used entries are evicted once the cached bytes exceed the capacity.
+    // Get never touches the file system for a cached file. Not thread safe, like the pool.
+    class content_cache
+    {
+    public:
+        using buffer = std::shared_ptr<const std::string>;
+
+    private:
+        struct entry
+        {
+            std::string Directory;
+            std::string Filename;
+            buffer Content;
+        };
+
+        using lru_list = std::list<entry>;
+
+        struct directory_state
+        {
+            std::unique_ptr<directory> Watch;
+            std::unordered_map<std::string, lru_list::iterator> Files;
+        };
+
+        global_watch_pool_type* pool_;
+        size_t capacity_;
+        size_t bytes_ = 0;
+        lru_list lru_; // most recently used first
+        std::unordered_map<std::string, directory_state> directories_;
+
+        void Erase(directory_state& state, lru_list::iterator iter)
+        {
+            bytes_ -= iter->Content->size();
+            state.Files.erase(iter->Filename);
+            lru_.erase(iter);
+        }
+
+        void EraseAll(directory_state& state)
+        {
+            while(!state.Files.empty())
+                Erase(state, state.Files.begin()->second);
+        }
+
+        // Reads the whole file with pread rather than through a mapping, so a file truncated
+        // while it is read comes back short instead of raising SIGBUS. Returns errno, zero on
+        // success.
+        static int Read(const std::string& path, std::string& content)
+        {
+            int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if(fd == -1)
+                return errno;
+
+            int error = 0;
+            struct stat info;
+            if(fstat(fd, &info) == -1)
+                error = errno;
+            else
+            {
+                content.resize(static_cast<size_t>(info.st_size));
+                size_t filled = 0;
+                while(filled < content.size())
+                {
+                    ssize_t read = pread(fd, &content[filled], content.size() - filled, (off_t)filled);
+                    if(read < 0 && errno == EINTR)
+                        continue;
+                    if(read < 0)
+                    {
+                        error = errno;
+                        break;
+                    }
+                    if(read == 0)
+                        break;
+                    filled += static_cast<size_t>(read);
+                }
+                content.resize(filled);
+            }
+            close(fd);
+            return error;
+        }
+
+        void Evict()
+        {
+            while(bytes_ > capacity_ && !lru_.empty())
+            {
+                auto iter = std::prev(lru_.end());
+                auto dir = directories_.find(iter->Directory);
+                Erase(dir->second, iter);
+                if(dir->second.Files.empty())
+                    directories_.erase(dir);
+            }
+        }
+
+    public:
+        content_cache(global_watch_pool_type* pool, size_t capacityBytes) :
+            pool_(pool),
+            capacity_(capacityBytes)
+        {}
+
+        content_cache(const content_cache&) = delete;
+        content_cache& operator=(const content_cache&) = delete;
+
+        // Contents of the file at path, read and cached on a miss. Returns null and sets error
+        // to errno when the file cannot be read, failures are not cached.
+        buffer Get(const std::string& path, int* error = nullptr)
+        {
+            if(error != nullptr)
+                *error = 0;
+
+            std::string dirName = file::DirectoryOf(path);
+            std::string filename = file::FilenameOf(path);
+
+            auto dir = directories_.find(dirName);
+            if(dir != directories_.end())
+            {
+                auto cached = dir->second.Files.find(filename);
+                if(cached != dir->second.Files.end())
+                {
+                    lru_.splice(lru_.begin(), lru_, cached->second);
+                    return cached->second->Content;
+                }
+            }
+            else
+            {
+                // watch before reading, so a write racing with the read still invalidates
+                directory_state state;
+                state.Watch.reset(new directory(dirName, pool_));
+                dir = directories_.emplace(dirName, std::move(state)).first;
+            }
+
+            std::string read;
+            int readError = Read(path, read);
+            if(readError != 0)
+            {
+                if(error != nullptr)
+                    *error = readError;
+                if(dir->second.Files.empty())
+                    directories_.erase(dir);
+                return nullptr;
+            }
+
+            buffer content = std::make_shared<const std::string>(std::move(read));
+            if(dir->second.Watch->Dead) // the directory cannot be watched, serve uncached
+                return content;
+
+            lru_.push_front(entry{dirName, filename, content});
+            dir->second.Files.emplace(filename, lru_.begin());
+            bytes_ += content->size();
+            Evict();
+            return content;
+        }
+
+        // Drains the watches and drops every entry whose file changed since it was cached.
+        void Refresh()
+        {
+            for(auto dir = directories_.begin(); dir != directories_.end();)
+            {
+                directory_state& state = dir->second;
+                directory_event event;
+                while(state.Watch->PollEvent(event))
+                {
+                    if(event.Type == directory_event::watch_directory_destroyed ||
+                       event.Type == directory_event::events_overflowed)
+                    {
+                        EraseAll(state);
+                        continue;
+                    }
+
+                    auto cached = state.Files.find(event.Name);
+                    if(cached != state.Files.end())
+                        Erase(state, cached->second);
+                }
+
+                if(state.Files.empty())
+                    dir = directories_.erase(dir);
+                else
+                    dir++;
+            }
+        }
+
+        void Invalidate(const std::string& path)
+        {
+            auto dir = directories_.find(file::DirectoryOf(path));
+            if(dir == directories_.end())
+                return;
+
+            auto cached = dir->second.Files.find(file::FilenameOf(path));
+            if(cached != dir->second.Files.end())
+                Erase(dir->second, cached->second);
+            if(dir->second.Files.empty())
+                directories_.erase(dir);
+        }
+
+        size_t Bytes() const
+        {
+            return bytes_;
+        }
+
+        size_t Entries() const
+        {
+            return lru_.size();
+        }
+    };
+}
@@ -0,0 +1,411 @@
+#pragma once
+
+#include "watch.h"
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace watch
+{
+    struct chunk_options
+    {
+        size_t MinBytes = 2 * 1024;
+        size_t AverageBytes = 8 * 1024; // rounded down to a power of two
+        size_t MaxBytes = 64 * 1024;
+        // Trust that a file which kept its inode and grew was only appended to, and rechunk
+        // from the start of its last chunk instead of from the beginning. Rewrites in place
+        // that also grow the file go unnoticed in that mode. Otherwise a changed file is read
+        // in full, events do not say where it changed.
+        bool AppendOnly = false;
+    };
+
+    // One content-defined chunk, Hash is a fast 64-bit hash meant for change detection.
+    struct chunk
+    {
+        uint64_t Offset;
+        uint32_t Length;
+        uint64_t Hash;
+    };
+
+    struct byte_range
+    {
+        uint64_t Offset;
+        uint64_t Length;
+    };
+
+    // Chunk boundaries and hashes of one file. Boundaries come from a gear rolling hash, so
+    // an edit only moves the boundaries next to it and chunks elsewhere keep their hashes;
+    // Update reports the byte ranges of the new contents not covered by an unchanged chunk.
+    // The file is read with pread through a bounded buffer, so it may change or shrink while
+    // it is being chunked; the result then covers whatever was read.
+    class chunked_file
+    {
+        constexpr static size_t ReadBytes = 1024 * 1024;
+        constexpr static int64_t RacyNs = 20 * 1000 * 1000; // coarser than any file system clock tick
+        
+        std::string path_;
+        chunk_options options_;
+        std::vector<chunk> chunks_;
+        uint64_t size_ = 0;
+        ino_t inode_ = 0;
+        int64_t modifiedNs_ = -1; // -1 when a write may have landed during the last pass
+        bool seeded_ = false;
+
+        static const uint64_t* Gear()
+        {
+            static const struct table
+            {
+                uint64_t Values[256];
+                table()
+                {
+                    for(uint64_t i = 0; i < 256; i++)
+                        Values[i] = watch_impl::mix(i + 0x9e3779b97f4a7c15ull);
+                }
+            } gear;
+            return gear.Values;
+        }
+
+        static uint64_t Hash(const unsigned char* data, size_t length)
+        {
+            uint64_t hash = watch_impl::mix(length);
+            size_t i = 0;
+            for(; i + 8 <= length; i += 8)
+            {
+                uint64_t word;
+                std::memcpy(&word, data + i, 8);
+                hash = watch_impl::mix(hash ^ word);
+            }
+            uint64_t tail = 0;
+            std::memcpy(&tail, data + i, length - i);
+            return watch_impl::mix(hash ^ tail);
+        }
+
+        static int64_t Nanoseconds(const struct timespec& time)
+        {
+            return static_cast<int64_t>(time.tv_sec) * 1000000000 + time.tv_nsec;
+        }
+        
+        // Length of the chunk starting at data, available bytes are buffered from there.
+        size_t Cut(const unsigned char* data, size_t available, unsigned bits, size_t minBytes, size_t maxBytes) const
+        {
+            const uint64_t* gear = Gear();
+            size_t limit = std::min(available, maxBytes);
+            size_t end = std::min(limit, minBytes);
+            uint64_t rolling = 0;
+            for(; end < limit; end++)
+            {
+                rolling = (rolling << 1) + gear[data[end]];
+                if(bits != 0 && (rolling >> (64 - bits)) == 0)
+                    return end + 1;
+            }
+            return end;
+        }
+        
+        // Splits the file from start to its end into chunks appended to out, size is set to
+        // where reading stopped. Returns errno on failure.
+        int Scan(int fd, uint64_t start, std::vector<chunk>& out, uint64_t& size) const
+        {
+            unsigned bits = 0;
+            while((size_t(2) << bits) <= options_.AverageBytes)
+                bits++;
+            size_t minBytes = std::max<size_t>(1, options_.MinBytes);
+            size_t maxBytes = std::max(minBytes, options_.MaxBytes);
+            
+            std::vector<unsigned char> buffer(std::max(ReadBytes, 2 * maxBytes));
+            uint64_t bufferOffset = start; // file offset of buffer[0]
+            size_t filled = 0;
+            bool end = false;
+            uint64_t begin = start;
+            while(true)
+            {
+                size_t used = static_cast<size_t>(begin - bufferOffset);
+                if(!end && filled - used < maxBytes)
+                {
+                    std::memmove(buffer.data(), buffer.data() + used, filled - used);
+                    filled -= used;
+                    bufferOffset = begin;
+                    used = 0;
+                    while(!end && filled < buffer.size())
+                    {
+                        ssize_t read = pread(fd, buffer.data() + filled, buffer.size() - filled, (off_t)(bufferOffset + filled));
+                        if(read < 0 && errno == EINTR)
+                            continue;
+                        if(read < 0)
+                            return errno;
+                        if(read == 0)
+                            end = true;
+                        filled += static_cast<size_t>(read);
+                    }
+                }
+                if(used == filled)
+                    break;
+                
+                size_t length = Cut(buffer.data() + used, filled - used, bits, minBytes, maxBytes);
+                out.push_back(chunk{begin, static_cast<uint32_t>(length), Hash(buffer.data() + used, length)});
+                begin += length;
+            }
+            size = begin;
+            return 0;
+        }
+        
+    public:
+        chunked_file(const std::string& path, const chunk_options& options = {}) :
+            path_(path),
+            options_(options)
+        {}
+
+        // Rechunks the file and appends the changed ranges of its current contents to changed.
+        // The first successful update only records the baseline, a file whose inode, size and
+        // modification time are unchanged is not read again. Returns errno on failure, keeping
+        // the previous state.
+        int Update(std::vector<byte_range>& changed)
+        {
+            int fd = open(path_.c_str(), O_RDONLY | O_CLOEXEC);
+            if(fd == -1)
+                return errno;
+            
+            struct stat info;
+            if(fstat(fd, &info) != 0)
+            {
+                int error = errno;
+                close(fd);
+                return error;
+            }
+            int64_t modifiedNs = Nanoseconds(info.st_mtim);
+            if(seeded_ && info.st_ino == inode_ && (uint64_t)info.st_size == size_ && modifiedNs == modifiedNs_)
+            {
+                close(fd);
+                return 0;
+            }
+            
+            std::vector<chunk> chunks;
+            uint64_t start = 0;
+            bool appended = options_.AppendOnly && seeded_ && info.st_ino == inode_ &&
+                            (uint64_t)info.st_size >= size_ && !chunks_.empty();
+            if(appended)
+            {
+                // everything before the last chunk stays, its end may move once more data follows
+                chunks.assign(chunks_.begin(), chunks_.end() - 1);
+                start = chunks_.back().Offset;
+            }
+            
+            struct timespec now;
+            clock_gettime(CLOCK_REALTIME, &now);
+            posix_fadvise(fd, (off_t)start, 0, POSIX_FADV_SEQUENTIAL);
+            uint64_t size = 0;
+            int error = Scan(fd, start, chunks, size);
+            close(fd);
+            if(error != 0)
+                return error;
+            
+            if(seeded_)
+            {
+                std::unordered_set<uint64_t> known;
+                for(size_t i = appended ? chunks_.size() - 1 : 0; i < chunks_.size(); i++)
+                    known.insert(chunks_[i].Hash);
+                
+                size_t first = appended ? chunks_.size() - 1 : 0;
+                for(size_t i = first; i < chunks.size(); i++)
+                {
+                    if(known.count(chunks[i].Hash) != 0)
+                        continue;
+                    if(!changed.empty() && changed.back().Offset + changed.back().Length == chunks[i].Offset)
+                        changed.back().Length += chunks[i].Length;
+                    else
+                        changed.push_back(byte_range{chunks[i].Offset, chunks[i].Length});
+                }
+            }
+            
+            chunks_.swap(chunks);
+            size_ = size;
+            inode_ = info.st_ino;
+            // a write in the same clock tick as the pass leaves the time unchanged, so it is
+            // only trusted once it is safely older than the pass
+            modifiedNs_ = modifiedNs + RacyNs < Nanoseconds(now) ? modifiedNs : -1;
+            seeded_ = true;
+            return 0;
+        }
+        
+        const std::string& Path() const { return path_; }
+        const std::vector<chunk>& Chunks() const { return chunks_; }
+        uint64_t Size() const { return size_; }
+    };
+
+    // What changed in one tracked file since its previous update.
+    struct chunk_change
+    {
+        std::string Path;
+        uint64_t Size = 0;
+        int Error = 0; // errno when the file could not be read, Ranges is empty then
+        std::vector<byte_range> Ranges;
+    };
+
+    // Keeps chunked_file state for a set of large files and rechunks them on worker threads
+    // when their file watches report a change. Track, Refresh and TakeChanges belong to the
+    // thread driving the pool; a file is never rechunked by two workers at once, changes
+    // arriving while it is being rechunked schedule one more pass.
+    class chunk_tracker
+    {
+        struct tracked
+        {
+            std::unique_ptr<file> Watch;
+            chunked_file State;
+            bool Busy = false;  // guarded by mutex_
+            bool Again = false; // guarded by mutex_
+            std::vector<byte_range> Ranges;
+            int Error = 0;
+
+            tracked(const std::string& path, global_watch_pool_type* pool, const chunk_options& options) :
+                Watch(new file(path, pool)),
+                State(path, options)
+            {}
+        };
+
+        global_watch_pool_type* pool_;
+        chunk_options options_;
+        std::unordered_map<std::string, std::unique_ptr<tracked>> files_;
+
+        std::mutex mutex_;
+        std::condition_variable wake_;
+        std::deque<tracked*> jobs_;
+        std::vector<tracked*> done_;
+        bool stop_ = false;
+        std::vector<std::thread> workers_;
+
+        void Run()
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            while(true)
+            {
+                wake_.wait(lock, [this]{ return stop_ || !jobs_.empty(); });
+                if(stop_)
+                    return;
+
+                tracked* job = jobs_.front();
+                jobs_.pop_front();
+                lock.unlock();
+                job->Ranges.clear();
+                job->Error = job->State.Update(job->Ranges);
+                lock.lock();
+                done_.push_back(job);
+            }
+        }
+
+        // Caller holds mutex_.
+        void Schedule(tracked* target)
+        {
+            if(target->Busy)
+            {
+                target->Again = true;
+                return;
+            }
+            target->Busy = true;
+            jobs_.push_back(target);
+            wake_.notify_one();
+        }
+
+    public:
+        chunk_tracker(global_watch_pool_type* pool, const chunk_options& options = {},
+                      unsigned threads = std::max(1u, std::thread::hardware_concurrency() / 2)) :
+            pool_(pool),
+            options_(options)
+        {
+            for(unsigned i = 0; i < std::max(1u, threads); i++)
+                workers_.emplace_back([this]{ Run(); });
+        }
+
+        chunk_tracker(const chunk_tracker&) = delete;
+        chunk_tracker& operator=(const chunk_tracker&) = delete;
+
+        ~chunk_tracker()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stop_ = true;
+            }
+            wake_.notify_all();
+            for(auto& worker : workers_)
+                worker.join();
+        }
+
+        // Starts tracking path, its baseline is chunked in the background.
+        void Track(const std::string& path)
+        {
+            auto inserted = files_.emplace(path, nullptr);
+            if(!inserted.second)
+                return;
+
+            inserted.first->second.reset(new tracked(path, pool_, options_));
+            std::lock_guard<std::mutex> lock(mutex_);
+            Schedule(inserted.first->second.get());
+        }
+
+        // Drains the file watches and queues every changed file for rechunking.
+        void Refresh()
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for(auto& entry : files_)
+            {
+                bool changed = false;
+                directory_event event;
+                while(entry.second->Watch->PollEvent(event))
+                    changed = changed || event.Type != directory_event::file_deleted;
+                if(changed)
+                    Schedule(entry.second.get());
+            }
+        }
+
+        // Moves finished results to out, skipping passes that found nothing new. Returns the
+        // number of changes added.
+        size_t TakeChanges(std::vector<chunk_change>& out)
+        {
+            std::vector<tracked*> done;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                done.swap(done_);
+                for(tracked* target : done)
+                    target->Busy = false;
+            }
+
+            size_t added = 0;
+            for(tracked* target : done)
+            {
+                if(target->Error != 0 || !target->Ranges.empty())
+                {
+                    chunk_change change;
+                    change.Path = target->State.Path();
+                    change.Size = target->State.Size();
+                    change.Error = target->Error;
+                    change.Ranges.swap(target->Ranges);
+                    out.push_back(std::move(change));
+                    added++;
+                }
+            }
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            for(tracked* target : done)
+            {
+                if(target->Again)
+                {
+                    target->Again = false;
+                    Schedule(target);
+                }
+            }
+            return added;
+        }
+
+        // Files queued or being rechunked.
+        size_t Pending()
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            size_t pending = 0;
+            for(auto& entry : files_)
+                pending += entry.second->Busy ? 1 : 0;
+            return pending;
+        }
+    };
+}
@@ -0,0 +1,256 @@
+#pragma once
+
+#include "watch.h"
+
+#include <functional>
+#include <map>
+#include <memory>
+
+namespace watch
+{
+    // Maps watched files to the targets built from them and targets to the targets built from
+    // those. On changes Poll computes the set of targets that need rebuilding, only what is
+    // reachable from the changed files, and hands it to the scheduler in batches. Every target
+    // has a level, one more than the highest level among its dependencies, maintained as edges
+    // are added; a batch holds the dirty targets of one level, so nothing in a batch depends on
+    // anything else in it and batches arrive in dependency order. The graph owns its pool and
+    // is not thread safe.
+    class dependency_graph
+    {
+    public:
+        using target_id = uint32_t;
+
+        // Rebuilds one batch, may run its targets in parallel and must return once all are done.
+        using scheduler_type = std::function<void(const std::vector<target_id>& batch)>;
+
+    private:
+        struct target
+        {
+            std::string Name;
+            std::vector<target_id> Dependents;
+            uint32_t Level = 0;
+            bool Dirty = false;
+        };
+
+        struct watched_directory
+        {
+            std::unique_ptr<directory> Watch;
+            std::unordered_map<std::string, std::vector<target_id>> Files;
+        };
+
+        global_watch_pool_type pool_;
+        std::vector<target> targets_;
+        std::unordered_map<std::string, watched_directory> directories_;
+        std::unordered_map<global_watch_pool_type::id_type, watched_directory*> byHandle_;
+        std::vector<target_id> changed_;
+        std::vector<global_watch_pool_type::id_type> dirty_;
+
+        void Touch(const std::vector<target_id>& direct)
+        {
+            changed_.insert(changed_.end(), direct.begin(), direct.end());
+        }
+
+        void TouchAll(const watched_directory& dir)
+        {
+            for(auto& file : dir.Files)
+                Touch(file.second);
+        }
+
+        // True if to can be reached from from by following dependents.
+        bool Reaches(target_id from, target_id to) const
+        {
+            std::vector<target_id> stack{from};
+            std::vector<bool> seen(targets_.size());
+            while(!stack.empty())
+            {
+                target_id current = stack.back();
+                stack.pop_back();
+                if(current == to)
+                    return true;
+                if(seen[current])
+                    continue;
+                seen[current] = true;
+                for(target_id next : targets_[current].Dependents)
+                    stack.push_back(next);
+            }
+            return false;
+        }
+
+        void Drain(watched_directory& dir)
+        {
+            directory& watch = *dir.Watch;
+            directory_event event;
+            while(pool_.Poll(watch.NativeHandle, watch.Ticket, event))
+            {
+                if(event.Type == directory_event::watch_directory_destroyed)
+                {
+                    byHandle_.erase(watch.NativeHandle);
+                    watch.Dead = true;
+                    TouchAll(dir);
+                    return;
+                }
+                if(event.Type == directory_event::events_overflowed)
+                {
+                    TouchAll(dir);
+                    continue;
+                }
+
+                auto iter = dir.Files.find(event.Name);
+                if(iter != dir.Files.end())
+                    Touch(iter->second);
+            }
+        }
+
+        void Register(watched_directory& dir)
+        {
+            if(!dir.Watch->Dead)
+                byHandle_[dir.Watch->NativeHandle] = &dir;
+        }
+
+    public:
+        dependency_graph() = default;
+
+        dependency_graph(const dependency_graph&) = delete;
+        dependency_graph& operator=(const dependency_graph&) = delete;
+
+        target_id AddTarget(const std::string& name)
+        {
+            targets_.push_back(target{name, {}, 0, false});
+            return static_cast<target_id>(targets_.size() - 1);
+        }
+
+        const std::string& Name(target_id id) const
+        {
+            return targets_[id].Name;
+        }
+
+        uint32_t Level(target_id id) const
+        {
+            return targets_[id].Level;
+        }
+
+        // Rebuild target when the file at path changes.
+        void DependsOnFile(target_id id, const std::string& path)
+        {
+            std::string dirName = file::DirectoryOf(path);
+            auto dir = directories_.find(dirName);
+            if(dir == directories_.end())
+            {
+                dir = directories_.emplace(dirName, watched_directory()).first;
+                dir->second.Watch.reset(new directory(dirName, &pool_));
+                Register(dir->second);
+            }
+
+            auto& targets = dir->second.Files[file::FilenameOf(path)];
+            if(std::find(targets.begin(), targets.end(), id) == targets.end())
+                targets.push_back(id);
+        }
+
+        // Rebuild id whenever dependency is rebuilt. Returns false, leaving the graph unchanged,
+        // if the edge would close a cycle.
+        bool DependsOn(target_id id, target_id dependency)
+        {
+            if(Reaches(id, dependency))
+                return false;
+
+            auto& dependents = targets_[dependency].Dependents;
+            if(std::find(dependents.begin(), dependents.end(), id) != dependents.end())
+                return true;
+            dependents.push_back(id);
+
+            // raise levels along the new edge, only targets whose level actually changes are visited
+            std::vector<std::pair<target_id, uint32_t>> stack{{id, targets_[dependency].Level + 1}};
+            while(!stack.empty())
+            {
+                auto current = stack.back();
+                stack.pop_back();
+                if(targets_[current.first].Level >= current.second)
+                    continue;
+                targets_[current.first].Level = current.second;
+                for(target_id next : targets_[current.first].Dependents)
+                    stack.emplace_back(next, current.second + 1);
+            }
+            return true;
+        }
+
+        // Marks the targets built from path as changed without waiting for an event.
+        void Invalidate(const std::string& path)
+        {
+            auto dir = directories_.find(file::DirectoryOf(path));
+            if(dir == directories_.end())
+                return;
+            auto iter = dir->second.Files.find(file::FilenameOf(path));
+            if(iter != dir->second.Files.end())
+                Touch(iter->second);
+        }
+
+        void Invalidate(target_id id)
+        {
+            changed_.push_back(id);
+        }
+
+        // Collects changes and passes the invalidated targets to schedule level by level.
+        // Returns the number of targets scheduled.
+        size_t Poll(const scheduler_type& schedule)
+        {
+            // lost directories come back once they exist again, everything in them may have changed
+            for(auto& entry : directories_)
+            {
+                watched_directory& dir = entry.second;
+                if(!dir.Watch->Dead)
+                    continue;
+                dir.Watch->Recreate();
+                if(!dir.Watch->Dead)
+                {
+                    Register(dir);
+                    TouchAll(dir);
+                }
+            }
+
+            pool_.Drain();
+
+            dirty_.clear();
+            pool_.TakeDirty(dirty_);
+            for(auto handle : dirty_)
+            {
+                auto iter = byHandle_.find(handle);
+                if(iter != byHandle_.end())
+                    Drain(*iter->second);
+            }
+
+            if(changed_.empty())
+                return 0;
+
+            // everything reachable from the changed targets, bucketed by level
+            std::map<uint32_t, std::vector<target_id>> levels;
+            std::vector<target_id> stack;
+            stack.swap(changed_);
+            while(!stack.empty())
+            {
+                target_id current = stack.back();
+                stack.pop_back();
+                if(targets_[current].Dirty)
+                    continue;
+                targets_[current].Dirty = true;
+                levels[targets_[current].Level].push_back(current);
+                for(target_id next : targets_[current].Dependents)
+                    stack.push_back(next);
+            }
+
+            // cleared up front, a throwing scheduler must not leave later levels marked forever
+            for(auto& level : levels)
+            {
+                for(target_id id : level.second)
+                    targets_[id].Dirty = false;
+            }
+            
+            size_t scheduled = 0;
+            for(auto& level : levels)
+            {
+                schedule(level.second);
+                scheduled += level.second.size();
+            }
+            return scheduled;
+        }
+    };
+}
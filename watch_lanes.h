@@ -0,0 +1,302 @@
+#pragma once
+
+#include "watch.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+extern "C"
+{
+#include "pthread.h"
+#include "sched.h"
+}
+
+namespace watch
+{
+    struct lane_options
+    {
+        unsigned Lanes = std::max(1u, std::thread::hardware_concurrency());
+        bool PinThreads = false; // pin lane i to cpu i modulo the cpu count
+    };
+
+    struct lane_stats
+    {
+        uint64_t Dispatched = 0; // events handed to the lane
+        uint64_t Processed = 0;  // events the handler returned from
+    };
+
+    // Drains a pool on the calling thread and hands each event to one of several consumer
+    // lanes, picked by a hash of the directory path and the file name. All events of a file go
+    // to the same lane in the order the pool queued them, while different files are handled
+    // in parallel. Events without a name, a destroyed directory or an events_overflowed
+    // marker, concern every file of the directory and are handed to every lane, after the
+    // events queued before them. The dispatcher owns its pool; Watch and Dispatch must be
+    // called from one thread.
+    class lane_dispatcher
+    {
+    public:
+        // Runs on the lane's thread, path is the watched directory.
+        using handler_type = std::function<void(unsigned lane, const std::string& path, const directory_event& event)>;
+
+    private:
+        struct routed_event
+        {
+            const std::string* Path;
+            directory_event Event;
+        };
+
+        struct alignas(64) lane
+        {
+            std::mutex Mutex;
+            std::condition_variable Wake;
+            std::condition_variable Idle;
+            std::vector<routed_event> Pending;
+            bool Busy = false;
+            bool Stop = false;
+            std::atomic<uint64_t> Dispatched{0};
+            std::atomic<uint64_t> Processed{0};
+            std::thread Thread;
+        };
+
+        struct watched
+        {
+            std::unique_ptr<directory> Watch;
+            watch_impl::generation_table::path_hash PathHash;
+        };
+
+        global_watch_pool_type pool_;
+        handler_type handler_;
+        std::vector<std::unique_ptr<lane>> lanes_;
+        std::vector<std::unique_ptr<watched>> watches_;
+        std::unordered_map<global_watch_pool_type::id_type, watched*> byHandle_;
+        std::vector<global_watch_pool_type::id_type> dirty_;
+        std::vector<std::vector<routed_event>> batches_; // per lane, reused between dispatches
+
+        void Run(unsigned index)
+        {
+            lane& self = *lanes_[index];
+            std::vector<routed_event> batch;
+            std::unique_lock<std::mutex> lock(self.Mutex);
+            while(true)
+            {
+                self.Wake.wait(lock, [&]{ return self.Stop || !self.Pending.empty(); });
+                if(self.Pending.empty())
+                    return;
+
+                batch.swap(self.Pending);
+                self.Busy = true;
+                lock.unlock();
+                for(auto& routed : batch)
+                {
+                    handler_(index, *routed.Path, routed.Event);
+                    self.Processed.fetch_add(1, std::memory_order_relaxed);
+                }
+                batch.clear();
+                lock.lock();
+                self.Busy = false;
+                if(self.Pending.empty())
+                    self.Idle.notify_all();
+            }
+        }
+
+        static void Pin(std::thread& thread, unsigned index)
+        {
+#ifdef __linux__
+            unsigned cpus = std::max(1u, std::thread::hardware_concurrency());
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(index % cpus, &set);
+            pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+#else
+            (void)thread;
+            (void)index;
+#endif
+        }
+
+        void Register(watched& target)
+        {
+            if(!target.Watch->Dead)
+                byHandle_[target.Watch->NativeHandle] = &target;
+        }
+
+        // Hashes the name bytes, not the interned id, which is recycled once no queued event
+        // uses it and would move a file between lanes across dispatches.
+        unsigned Lane(watch_impl::generation_table::path_hash hash, std::string_view name) const
+        {
+            return static_cast<unsigned>(watch_impl::mix(hash.Separator().Append(name).Key()) % lanes_.size());
+        }
+
+        void Route(watched& source, directory_event& event)
+        {
+            if(event.Name.empty())
+            {
+                for(auto& batch : batches_)
+                    batch.push_back(routed_event{&source.Watch->Path, event});
+                return;
+            }
+
+            unsigned index = Lane(source.PathHash, event.Name);
+            batches_[index].push_back(routed_event{&source.Watch->Path, std::move(event)});
+        }
+
+    public:
+        lane_dispatcher(handler_type handler, const lane_options& options = {}) :
+            pool_(),
+            handler_(std::move(handler))
+        {
+            unsigned count = std::max(1u, options.Lanes);
+            batches_.resize(count);
+            for(unsigned i = 0; i < count; i++)
+                lanes_.emplace_back(new lane());
+            for(unsigned i = 0; i < count; i++)
+            {
+                lanes_[i]->Thread = std::thread([this, i]{ Run(i); });
+                if(options.PinThreads)
+                    Pin(lanes_[i]->Thread, i);
+            }
+        }
+
+        lane_dispatcher(const lane_dispatcher&) = delete;
+        lane_dispatcher& operator=(const lane_dispatcher&) = delete;
+
+        // Lanes finish the events already handed to them before the threads exit.
+        ~lane_dispatcher()
+        {
+            for(auto& target : lanes_)
+            {
+                std::lock_guard<std::mutex> lock(target->Mutex);
+                target->Stop = true;
+            }
+            for(auto& target : lanes_)
+            {
+                target->Wake.notify_one();
+                target->Thread.join();
+            }
+        }
+
+        void Watch(const std::string& path)
+        {
+            std::unique_ptr<watched> target(new watched{std::unique_ptr<directory>(new directory(path, &pool_)),
+                                                        watch_impl::generation_table::path_hash().Append(path)});
+            Register(*target);
+            watches_.push_back(std::move(target));
+        }
+
+        // Moves every queued event to its lane, returns the number dispatched.
+        size_t Dispatch()
+        {
+            for(auto& target : watches_)
+            {
+                directory_event marker;
+                if(!target->Watch->Dead || !target->Watch->Revive(marker))
+                    continue;
+                Register(*target);
+                Route(*target, marker);
+            }
+
+            pool_.Drain();
+
+            dirty_.clear();
+            pool_.TakeDirty(dirty_);
+            for(auto handle : dirty_)
+            {
+                auto iter = byHandle_.find(handle);
+                if(iter == byHandle_.end())
+                    continue;
+
+                watched& source = *iter->second;
+                directory& watch = *source.Watch;
+                directory_event event;
+                while(pool_.Poll(watch.NativeHandle, watch.Ticket, event))
+                {
+                    bool destroyed = event.Type == directory_event::watch_directory_destroyed;
+                    Route(source, event);
+                    if(destroyed)
+                    {
+                        byHandle_.erase(iter);
+                        watch.Dead = true;
+                        break;
+                    }
+                }
+            }
+
+            size_t dispatched = 0;
+            for(size_t i = 0; i < lanes_.size(); i++)
+            {
+                auto& batch = batches_[i];
+                if(batch.empty())
+                    continue;
+
+                PROFILE(handoff)
+                lane& target = *lanes_[i];
+                size_t count = batch.size();
+                {
+                    std::lock_guard<std::mutex> lock(target.Mutex);
+                    if(target.Pending.empty())
+                        target.Pending.swap(batch);
+                    else
+                        std::move(batch.begin(), batch.end(), std::back_inserter(target.Pending));
+                }
+                target.Wake.notify_one();
+                target.Dispatched.fetch_add(count, std::memory_order_relaxed);
+                dispatched += count;
+                batch.clear();
+            }
+            return dispatched;
+        }
+
+        // Blocks until every lane handled everything dispatched so far.
+        void Flush()
+        {
+            for(auto& target : lanes_)
+            {
+                std::unique_lock<std::mutex> lock(target->Mutex);
+                target->Idle.wait(lock, [&]{ return target->Pending.empty() && !target->Busy; });
+            }
+        }
+
+        unsigned Lanes() const
+        {
+            return static_cast<unsigned>(lanes_.size());
+        }
+
+        // The lane that every event of the file name in the directory path goes to.
+        unsigned LaneOf(const std::string& path, std::string_view name) const
+        {
+            return Lane(watch_impl::generation_table::path_hash().Append(path), name);
+        }
+
+        lane_stats Stats(unsigned index) const
+        {
+            lane_stats stats;
+            stats.Dispatched = lanes_[index]->Dispatched.load(std::memory_order_relaxed);
+            stats.Processed = lanes_[index]->Processed.load(std::memory_order_relaxed);
+            return stats;
+        }
+
+        // Events dispatched to the busiest lane divided by the mean per lane, 1 when perfectly
+        // balanced and Lanes() when one lane got everything. Zero before anything was dispatched.
+        double Imbalance() const
+        {
+            uint64_t total = 0, busiest = 0;
+            for(auto& target : lanes_)
+            {
+                uint64_t dispatched = target->Dispatched.load(std::memory_order_relaxed);
+                total += dispatched;
+                busiest = std::max(busiest, dispatched);
+            }
+            return total == 0 ? 0.0 : double(busiest) * lanes_.size() / double(total);
+        }
+
+        int Descriptor() const
+        {
+            return pool_.Descriptor();
+        }
+    };
+}
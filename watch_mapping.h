@@ -0,0 +1,134 @@
+#pragma once
+
+#include "watch.h"
+#include "watch_mmap.h"
+
+#include <atomic>
+#include <memory>
+
+namespace watch
+{
+    // A file mapped once and mapped again whenever the watcher reports it was replaced or
+    // changed size. Readers take a view, which keeps the mapping it was taken from alive until
+    // the view is dropped, so a remap never unmaps memory under a reader. That only keeps views
+    // readable for files replaced by rename: a file truncated in place shrinks under every
+    // mapping of it, and reading a view past the new end raises SIGBUS. Refresh remaps such a
+    // file, but views taken before it stay dangerous until they are dropped. Refresh must be
+    // called from the thread driving the pool, Acquire may be called from any thread.
+    class watched_mapping
+    {
+    public:
+        class view
+        {
+            std::shared_ptr<const mapped_file> mapping_;
+            uint64_t epoch_ = 0;
+
+        public:
+            view() = default;
+
+            view(std::shared_ptr<const mapped_file> mapping, uint64_t epoch) :
+                mapping_(std::move(mapping)),
+                epoch_(epoch)
+            {}
+
+            const char* Data() const { return mapping_ ? mapping_->Data() : nullptr; }
+            size_t Size() const { return mapping_ ? mapping_->Size() : 0; }
+            std::string_view View() const { return mapping_ ? mapping_->View() : std::string_view(); }
+
+            // Number of the mapping this view belongs to, it grows by one with every remap.
+            uint64_t Epoch() const { return epoch_; }
+
+            explicit operator bool() const
+            {
+                return mapping_ != nullptr;
+            }
+        };
+
+    private:
+        struct published
+        {
+            std::shared_ptr<const mapped_file> Mapping;
+            uint64_t Epoch;
+        };
+
+        std::string path_;
+        file file_;
+        std::shared_ptr<const published> current_;
+        std::atomic<int> error_{0};
+
+        void Map(uint64_t epoch)
+        {
+            auto mapping = std::make_shared<mapped_file>(path_);
+            if(mapping->Error() != 0)
+            {
+                error_.store(mapping->Error());
+                return;
+            }
+            error_.store(0);
+            std::atomic_store(&current_, std::make_shared<const published>(published{std::move(mapping), epoch}));
+        }
+
+        // True when the file on disk is no longer the one mapped, or its size changed.
+        bool Stale() const
+        {
+            auto current = std::atomic_load(&current_);
+            struct stat info;
+            if(stat(path_.c_str(), &info) == -1)
+                return false; // keep serving the old contents until a new file shows up
+            if(current == nullptr)
+                return true;
+            return info.st_ino != current->Mapping->Inode() ||
+                   static_cast<size_t>(info.st_size) != current->Mapping->Size();
+        }
+
+    public:
+        watched_mapping(const std::string& path, global_watch_pool_type* pool) :
+            path_(path),
+            file_(path, pool)
+        {
+            Map(1);
+        }
+
+        watched_mapping(const watched_mapping&) = delete;
+        watched_mapping& operator=(const watched_mapping&) = delete;
+
+        // The current mapping, empty if the file could never be mapped.
+        view Acquire() const
+        {
+            auto current = std::atomic_load(&current_);
+            return current == nullptr ? view() : view(current->Mapping, current->Epoch);
+        }
+
+        // Consumes the file's events and remaps if needed, returns true when a new mapping was published.
+        bool Refresh()
+        {
+            bool changed = false;
+            directory_event event;
+            while(file_.PollEvent(event))
+                changed = true;
+
+            // the directory watch was lost, so look at the file directly
+            if(!changed && !file_.DirectoryWatcher.Dead)
+                return false;
+            if(!Stale())
+                return false;
+
+            auto current = std::atomic_load(&current_);
+            uint64_t epoch = current == nullptr ? 1 : current->Epoch + 1;
+            Map(epoch);
+            return Epoch() == epoch;
+        }
+
+        uint64_t Epoch() const
+        {
+            auto current = std::atomic_load(&current_);
+            return current == nullptr ? 0 : current->Epoch;
+        }
+
+        // errno of the last failed mapping attempt, zero once mapping succeeded.
+        int LastError() const
+        {
+            return error_.load();
+        }
+    };
+}
@@ -0,0 +1,286 @@
+#pragma once
+
+#include "watch.h"
+
+#include <chrono>
+#include <deque>
+#include <limits>
+#include <memory>
+#include <vector>
+
+namespace watch
+{
+    // An event together with where and when it was drained. Timestamps are steady clock
+    // nanoseconds and strictly increase from one drain of a shard to the next; events drained
+    // together share one timestamp and are ordered by Sequence.
+    struct stamped_event
+    {
+        uint32_t Shard = 0;
+        uint64_t Sequence = 0;  // per shard, starts at 1
+        int64_t Timestamp = 0;
+        const std::string* Path = nullptr; // watched directory, owned by the shard
+        directory_event Event;
+    };
+
+    // Merges per-shard event streams into one stream ordered by (Timestamp, Shard, Sequence).
+    // Each shard gets a buffer of bounded size, Push fails once it is full. An event is only
+    // released once every other shard either has a later event buffered, promised with Advance
+    // that it has nothing earlier, or was closed, so a quiet shard holds the stream back until
+    // it advances. The heads of all shards sit in a loser tree, so releasing an event costs
+    // one comparison per tree level. Not thread safe.
+    class event_merger
+    {
+        struct input
+        {
+            std::deque<stamped_event> Buffer;
+            int64_t Watermark = std::numeric_limits<int64_t>::min();
+            bool Closed = false;
+        };
+
+        // Ordering key of a shard's head, or of the earliest event it could still produce.
+        struct key
+        {
+            int64_t Timestamp;
+            uint32_t Shard;
+            uint64_t Sequence;
+
+            bool operator<(const key& other) const
+            {
+                if(Timestamp != other.Timestamp)
+                    return Timestamp < other.Timestamp;
+                if(Shard != other.Shard)
+                    return Shard < other.Shard;
+                return Sequence < other.Sequence;
+            }
+        };
+
+        std::vector<input> inputs_;
+        size_t capacity_;
+        size_t leaves_;             // inputs rounded up to a power of two, extra leaves never win
+        std::vector<uint32_t> losers_; // internal nodes 1 .. leaves_ - 1
+        uint32_t winner_ = 0;
+        bool rebuild_ = true;
+        size_t buffered_ = 0;
+
+        key KeyOf(uint32_t leaf) const
+        {
+            constexpr int64_t Never = std::numeric_limits<int64_t>::max();
+            if(leaf >= inputs_.size())
+                return key{Never, leaf, 0};
+
+            const input& source = inputs_[leaf];
+            if(!source.Buffer.empty())
+            {
+                const stamped_event& head = source.Buffer.front();
+                return key{head.Timestamp, leaf, head.Sequence};
+            }
+            if(source.Closed || source.Watermark == Never)
+                return key{Never, leaf, 0};
+            return key{source.Watermark + 1, leaf, 0};
+        }
+
+        bool Less(uint32_t a, uint32_t b) const
+        {
+            return KeyOf(a) < KeyOf(b);
+        }
+
+        // Full tournament, needed when a key other than the winner's changed.
+        void Build()
+        {
+            std::vector<uint32_t> winners(2 * leaves_);
+            for(uint32_t i = 0; i < leaves_; i++)
+                winners[leaves_ + i] = i;
+            for(size_t node = leaves_ - 1; node >= 1; node--)
+            {
+                uint32_t a = winners[2 * node], b = winners[2 * node + 1];
+                if(Less(b, a))
+                    std::swap(a, b);
+                winners[node] = a;
+                losers_[node] = b;
+            }
+            winner_ = winners[1];
+            rebuild_ = false;
+        }
+
+        // Replays the path of the winning leaf after its key changed.
+        void Replay(uint32_t leaf)
+        {
+            uint32_t candidate = leaf;
+            for(size_t node = (leaves_ + leaf) / 2; node >= 1; node /= 2)
+            {
+                if(Less(losers_[node], candidate))
+                    std::swap(losers_[node], candidate);
+            }
+            winner_ = candidate;
+        }
+
+    public:
+        // capacity is the most events buffered per shard.
+        explicit event_merger(size_t shards, size_t capacity = 4096) :
+            inputs_(std::max<size_t>(1, shards)),
+            capacity_(std::max<size_t>(1, capacity)),
+            leaves_(2)
+        {
+            while(leaves_ < inputs_.size())
+                leaves_ *= 2;
+            losers_.resize(leaves_);
+        }
+
+        // Returns false, leaving event untouched, when the shard's buffer is full.
+        bool Push(uint32_t shard, stamped_event& event)
+        {
+            input& target = inputs_[shard];
+            if(target.Buffer.size() >= capacity_)
+                return false;
+            if(target.Buffer.empty())
+                rebuild_ = true;
+            event.Shard = shard;
+            target.Buffer.push_back(std::move(event));
+            buffered_++;
+            return true;
+        }
+
+        // The shard will not push anything with a timestamp at or below watermark.
+        void Advance(uint32_t shard, int64_t watermark)
+        {
+            input& target = inputs_[shard];
+            if(watermark <= target.Watermark)
+                return;
+            target.Watermark = watermark;
+            if(target.Buffer.empty())
+                rebuild_ = true;
+        }
+
+        // The shard will not push anything anymore.
+        void Close(uint32_t shard)
+        {
+            inputs_[shard].Closed = true;
+            rebuild_ = true;
+        }
+
+        // Takes the next event in global order, false when none can be released yet.
+        bool Next(stamped_event& event)
+        {
+            if(rebuild_)
+                Build();
+
+            uint32_t leaf = winner_;
+            if(leaf >= inputs_.size() || inputs_[leaf].Buffer.empty())
+                return false;
+
+            input& source = inputs_[leaf];
+            event = std::move(source.Buffer.front());
+            source.Buffer.pop_front();
+            buffered_--;
+            Replay(leaf);
+            return true;
+        }
+
+        bool Full(uint32_t shard) const
+        {
+            return inputs_[shard].Buffer.size() >= capacity_;
+        }
+
+        size_t Buffered() const
+        {
+            return buffered_;
+        }
+
+        size_t Shards() const
+        {
+            return inputs_.size();
+        }
+    };
+
+    // The directories of one pool, drained and stamped as one shard of a merger. Must be used
+    // from the thread driving its pool.
+    class event_shard
+    {
+        global_watch_pool_type* pool_;
+        uint32_t shard_;
+        uint64_t sequence_ = 0;
+        int64_t last_ = std::numeric_limits<int64_t>::min();
+        std::vector<std::unique_ptr<directory>> watches_;
+        stamped_event carried_; // polled but not accepted by a full merger
+        bool carrying_ = false;
+
+        static int64_t Now()
+        {
+            auto now = std::chrono::steady_clock::now().time_since_epoch();
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(now).count();
+        }
+        
+        // Next queued event of a watch, the pool was drained already. A watch that comes back
+        // after it was lost starts with a subtree marker.
+        bool Next(directory& watch, directory_event& event)
+        {
+            if(watch.Dead)
+                return watch.Revive(event);
+            if(!pool_->Poll(watch.NativeHandle, watch.Ticket, event))
+                return false;
+            if(event.Type == directory_event::watch_directory_destroyed)
+                watch.Dead = true;
+            return true;
+        }
+
+    public:
+        event_shard(global_watch_pool_type* pool, uint32_t shard) :
+            pool_(pool),
+            shard_(shard)
+        {}
+
+        event_shard(const event_shard&) = delete;
+        event_shard& operator=(const event_shard&) = delete;
+
+        void Watch(const std::string& path)
+        {
+            watches_.emplace_back(new directory(path, pool_));
+        }
+
+        // Pushes the pool's pending events to merger, stamped with one new timestamp. Stops
+        // early when the shard's buffer fills up, the rest stays queued in the pool. Only a
+        // complete drain advances the shard's watermark. Returns the number of events pushed.
+        size_t Drain(event_merger& merger)
+        {
+            size_t pushed = 0;
+            if(carrying_)
+            {
+                if(!merger.Push(shard_, carried_))
+                    return 0;
+                carrying_ = false;
+                pushed++;
+            }
+
+            int64_t timestamp = std::max(Now(), last_ + 1);
+            pool_->Drain();
+
+            for(auto& watch : watches_)
+            {
+                stamped_event stamped;
+                while(Next(*watch, stamped.Event))
+                {
+                    stamped.Sequence = ++sequence_;
+                    stamped.Timestamp = timestamp;
+                    stamped.Path = &watch->Path;
+                    if(!merger.Push(shard_, stamped))
+                    {
+                        carried_ = std::move(stamped);
+                        carrying_ = true;
+                        last_ = timestamp;
+                        return pushed;
+                    }
+                    pushed++;
+                }
+            }
+
+            last_ = timestamp;
+            merger.Advance(shard_, timestamp);
+            return pushed;
+        }
+
+        uint32_t Shard() const
+        {
+            return shard_;
+        }
+    };
+}
@@ -0,0 +1,176 @@
+#pragma once
+
+#include "watch_tree.h"
+
+namespace watch
+{
+    // A tree_watch that also keeps a Merkle digest of every directory, over the name, size and
+    // modification time of each file and the name and digest of each subdirectory. A directory
+    // sums the hashes of its entries, so an event changes one term of its directory's sum and
+    // then one term per ancestor, never rehashing siblings. Inodes are left out, so two copies
+    // of a tree on different machines agree as long as names, sizes and times do; equal digests
+    // let a comparison skip a whole subtree, so only differing paths and their ancestors are visited.
+    class merkle_tree_watch : public tree_watch
+    {
+        std::unordered_map<const node*, uint64_t> sums_;
+
+        static uint64_t HashName(const std::string& name)
+        {
+            uint64_t hash = 0xcbf29ce484222325ull;
+            for(unsigned char c : name)
+            {
+                hash ^= c;
+                hash *= 0x100000001b3ull;
+            }
+            return hash;
+        }
+
+        static uint64_t FileHash(const std::string& name, const file_info& info)
+        {
+            return watch_impl::mix(HashName(name) ^ watch_impl::mix(info.Size ^ watch_impl::mix(static_cast<uint64_t>(info.ModifiedNs))));
+        }
+
+        static uint64_t ChildHash(const std::string& name, uint64_t digest)
+        {
+            return watch_impl::mix(HashName(name) ^ watch_impl::mix(digest + 0x9e3779b97f4a7c15ull));
+        }
+
+        // Finalizes a sum, so an empty directory and a missing one differ from zero.
+        static uint64_t Seal(uint64_t sum)
+        {
+            return watch_impl::mix(sum ^ 0x6d65726b6c650000ull);
+        }
+
+        uint64_t SumOf(const node* target) const
+        {
+            auto iter = sums_.find(target);
+            return iter == sums_.end() ? 0 : iter->second;
+        }
+
+        // Replaces one term of target's sum and carries the new digest up to the root.
+        void Update(node* target, uint64_t remove, uint64_t add)
+        {
+            while(remove != add)
+            {
+                uint64_t& sum = sums_[target];
+                uint64_t before = Seal(sum);
+                sum += add - remove;
+                if(target->Parent == nullptr)
+                    return;
+                remove = ChildHash(target->Name, before);
+                add = ChildHash(target->Name, Seal(sum));
+                target = target->Parent;
+            }
+        }
+
+        void Forget(const node* target)
+        {
+            for(auto& child : target->Children)
+                Forget(child.second.get());
+            sums_.erase(target);
+        }
+
+        // Digest of a subtree computed from scratch, used once the base class has seeded the tree.
+        uint64_t Compute(const node* target)
+        {
+            uint64_t sum = 0;
+            for(auto& file : target->Files)
+                sum += FileHash(file.first, file.second);
+            for(auto& child : target->Children)
+                sum += ChildHash(child.first, Compute(child.second.get()));
+            sums_[target] = sum;
+            return Seal(sum);
+        }
+
+        void OnFileChanged(node* parent, const std::string& name, const file_info* old, const file_info* now) override
+        {
+            Update(parent, old == nullptr ? 0 : FileHash(name, *old), now == nullptr ? 0 : FileHash(name, *now));
+        }
+
+        void OnChildChanged(node* parent, node* child, bool added) override
+        {
+            if(added)
+            {
+                sums_[child] = 0;
+                Update(parent, 0, ChildHash(child->Name, Seal(0)));
+                return;
+            }
+            uint64_t digest = Seal(SumOf(child));
+            Forget(child);
+            Update(parent, ChildHash(child->Name, digest), 0);
+        }
+
+        static void Compare(const node* a, const node* b, const std::string& prefix,
+                            std::vector<std::string>& differing, const merkle_tree_watch& left,
+                            const merkle_tree_watch& right)
+        {
+            for(auto& file : a->Files)
+            {
+                auto other = b->Files.find(file.first);
+                if(other == b->Files.end() || FileHash(file.first, file.second) != FileHash(other->first, other->second))
+                    differing.push_back(prefix + file.first);
+            }
+            for(auto& file : b->Files)
+                if(a->Files.find(file.first) == a->Files.end())
+                    differing.push_back(prefix + file.first);
+
+            for(auto& child : a->Children)
+            {
+                auto other = b->Children.find(child.first);
+                if(other == b->Children.end())
+                    differing.push_back(prefix + child.first);
+                else if(left.SumOf(child.second.get()) != right.SumOf(other->second.get()))
+                    Compare(child.second.get(), other->second.get(), prefix + child.first + "/", differing, left, right);
+            }
+            for(auto& child : b->Children)
+                if(a->Children.find(child.first) == a->Children.end())
+                    differing.push_back(prefix + child.first);
+        }
+
+    public:
+        explicit merkle_tree_watch(const std::string& root, unsigned threads = std::thread::hardware_concurrency()) :
+            tree_watch(root, threads)
+        {
+            // the base constructor cannot reach the overrides, so the seeded tree is hashed here
+            Compute(root_.get());
+        }
+
+        // Digest of the subtree at path, zero for paths outside the tree.
+        uint64_t Digest(const std::string& path) const
+        {
+            auto iter = byPath_.find(Trim(path));
+            return iter == byPath_.end() ? 0 : Seal(SumOf(iter->second));
+        }
+
+        uint64_t Digest() const
+        {
+            return Seal(SumOf(root_.get()));
+        }
+
+        // Hashes of the entries of the directory at path, what a peer needs to decide which
+        // entries to descend into. Subdirectory names end with a slash.
+        std::vector<std::pair<std::string, uint64_t>> Entries(const std::string& path) const
+        {
+            std::vector<std::pair<std::string, uint64_t>> result;
+            auto iter = byPath_.find(Trim(path));
+            if(iter == byPath_.end())
+                return result;
+
+            for(auto& file : iter->second->Files)
+                result.emplace_back(file.first, FileHash(file.first, file.second));
+            for(auto& child : iter->second->Children)
+                result.emplace_back(child.first + "/", ChildHash(child.first, Seal(SumOf(child.second.get()))));
+            return result;
+        }
+
+        // Paths, relative to the roots, of the files and directories that differ between two
+        // trees. A directory present on only one side is reported once, without its contents.
+        static std::vector<std::string> Differences(const merkle_tree_watch& left, const merkle_tree_watch& right)
+        {
+            std::vector<std::string> differing;
+            if(left.Digest() != right.Digest())
+                Compare(left.root_.get(), right.root_.get(), std::string(), differing, left, right);
+            return differing;
+        }
+    };
+}
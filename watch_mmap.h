@@ -0,0 +1,111 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <cerrno>
+
+extern "C"
+{
+#include "sys/mman.h"
+#include "sys/stat.h"
+#include "fcntl.h"
+#include "unistd.h"
+}
+
+namespace watch
+{
+    // Read-only private mapping of a whole file. Error holds errno when opening or mapping
+    // failed, an empty file maps to a null Data with Error zero.
+    class mapped_file
+    {
+        const char* data_ = nullptr;
+        size_t size_ = 0;
+        int error_ = 0;
+        ino_t inode_ = 0;
+
+        void Reset()
+        {
+            if(data_ != nullptr)
+                munmap((void*)data_, size_);
+            data_ = nullptr;
+            size_ = 0;
+        }
+
+    public:
+        mapped_file() = default;
+
+        explicit mapped_file(const std::string& path)
+        {
+            int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if(fd == -1)
+            {
+                error_ = errno;
+                return;
+            }
+
+            struct stat info;
+            if(fstat(fd, &info) == -1)
+                error_ = errno;
+            else
+            {
+                inode_ = info.st_ino;
+                size_ = static_cast<size_t>(info.st_size);
+                if(size_ != 0)
+                {
+                    void* mapping = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+                    if(mapping == MAP_FAILED)
+                    {
+                        error_ = errno;
+                        size_ = 0;
+                    }
+                    else
+                        data_ = (const char*)mapping;
+                }
+            }
+            close(fd);
+        }
+
+        mapped_file(mapped_file&& other) :
+            data_(other.data_),
+            size_(other.size_),
+            error_(other.error_),
+            inode_(other.inode_)
+        {
+            other.data_ = nullptr;
+            other.size_ = 0;
+        }
+
+        mapped_file& operator=(mapped_file&& other)
+        {
+            if(this != &other)
+            {
+                Reset();
+                data_ = other.data_;
+                size_ = other.size_;
+                error_ = other.error_;
+                inode_ = other.inode_;
+                other.data_ = nullptr;
+                other.size_ = 0;
+            }
+            return *this;
+        }
+
+        mapped_file(const mapped_file&) = delete;
+        mapped_file& operator=(const mapped_file&) = delete;
+
+        ~mapped_file()
+        {
+            Reset();
+        }
+
+        const char* Data() const { return data_; }
+        size_t Size() const { return size_; }
+        int Error() const { return error_; }
+        ino_t Inode() const { return inode_; }
+
+        std::string_view View() const
+        {
+            return std::string_view(data_, size_);
+        }
+    };
+}
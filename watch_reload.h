@@ -0,0 +1,186 @@
+#pragma once
+
+#include "watch.h"
+#include "watch_mmap.h"
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <functional>
+#include <chrono>
+
+extern "C"
+{
+#include "poll.h"
+#include "sys/eventfd.h"
+}
+
+namespace watch
+{
+    // Keeps a parsed copy of a config file current. Changes are debounced until the file has
+    // been quiet for the settle time, then the file is mapped and parsed once on a worker
+    // thread and the result is published atomically. Readers never parse and never wait for
+    // the worker, a failed load or parse keeps the previous config published.
+    template<typename T>
+    class config_reloader
+    {
+    public:
+        using parser_type = std::function<T(std::string_view content)>;
+
+        // Per-thread reader handle. Get costs one atomic load while the config is unchanged and
+        // only reloads the shared pointer after a new config was published.
+        class reader
+        {
+            const config_reloader* source_;
+            uint64_t version_ = 0;
+            std::shared_ptr<const T> cached_;
+
+        public:
+            explicit reader(const config_reloader& source) :
+                source_(&source)
+            {}
+
+            const std::shared_ptr<const T>& Get()
+            {
+                uint64_t version = source_->version_.load(std::memory_order_acquire);
+                if(version != version_)
+                {
+                    cached_ = source_->Get();
+                    version_ = version;
+                }
+                return cached_;
+            }
+        };
+
+    private:
+        constexpr static int RetryIntervalMs = 1000; // how often a missing directory is looked for again
+
+        std::string path_;
+        parser_type parser_;
+        std::chrono::milliseconds settle_;
+
+        std::shared_ptr<const T> current_;
+        std::atomic<uint64_t> version_{0};
+        std::atomic<int> error_{0};
+        std::atomic<bool> stop_{false};
+        int wakeup_;
+
+        // only touched by the worker once constructed
+        global_watch_pool_type pool_;
+        file file_;
+        std::thread worker_;
+
+        void Load()
+        {
+            mapped_file mapping(path_);
+            if(mapping.Error() != 0)
+            {
+                error_.store(mapping.Error());
+                return;
+            }
+
+            try
+            {
+                std::shared_ptr<const T> parsed = std::make_shared<const T>(parser_(mapping.View()));
+                std::atomic_store(&current_, std::move(parsed));
+                error_.store(0);
+                version_.fetch_add(1, std::memory_order_release);
+            }
+            catch(...)
+            {
+                error_.store(EINVAL);
+            }
+        }
+
+        void Run()
+        {
+            using clock = std::chrono::steady_clock;
+
+            bool pending = false;
+            bool wasDead = file_.DirectoryWatcher.Dead;
+            clock::time_point lastChange;
+
+            while(!stop_.load())
+            {
+                int timeout = -1;
+                if(pending)
+                {
+                    auto remaining = settle_ - (clock::now() - lastChange);
+                    timeout = std::max<int>(0, (int)std::chrono::duration_cast<std::chrono::milliseconds>(remaining).count());
+                }
+                else if(wasDead)
+                    timeout = RetryIntervalMs;
+
+                pollfd fds[2] = {{pool_.Descriptor(), POLLIN, 0}, {wakeup_, POLLIN, 0}};
+                poll(fds, 2, timeout);
+
+                directory_event event;
+                while(file_.PollEvent(event))
+                {
+                    pending = true;
+                    lastChange = clock::now();
+                }
+
+                // the file may have appeared together with its directory, without any event
+                bool dead = file_.DirectoryWatcher.Dead;
+                if(wasDead && !dead)
+                {
+                    pending = true;
+                    lastChange = clock::now();
+                }
+                wasDead = dead;
+
+                if(pending && clock::now() - lastChange >= settle_)
+                {
+                    pending = false;
+                    Load();
+                }
+            }
+        }
+
+    public:
+        config_reloader(const std::string& path, parser_type parser,
+                        std::chrono::milliseconds settle = std::chrono::milliseconds(100)) :
+            path_(path),
+            parser_(std::move(parser)),
+            settle_(settle),
+            wakeup_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+            pool_(),
+            file_(path, &pool_)
+        {
+            Load(); // the first config is available as soon as the constructor returns
+            worker_ = std::thread([this]{ Run(); });
+        }
+
+        config_reloader(const config_reloader&) = delete;
+        config_reloader& operator=(const config_reloader&) = delete;
+
+        ~config_reloader()
+        {
+            stop_.store(true);
+            uint64_t one = 1;
+            ssize_t written = write(wakeup_, &one, sizeof(one));
+            (void)written;
+            worker_.join();
+            close(wakeup_);
+        }
+
+        // The current config, null until the file was loaded successfully once.
+        std::shared_ptr<const T> Get() const
+        {
+            return std::atomic_load(&current_);
+        }
+
+        // Incremented every time a new config is published.
+        uint64_t Version() const
+        {
+            return version_.load(std::memory_order_acquire);
+        }
+
+        // errno of the last failed load, EINVAL if the parser threw, zero after a successful load.
+        int LastError() const
+        {
+            return error_.load();
+        }
+    };
+}
@@ -0,0 +1,277 @@
+#pragma once
+
+#include "watch.h"
+
+#include <atomic>
+#include <iterator>
+#include <thread>
+#include <vector>
+
+extern "C"
+{
+#include "dirent.h"
+#include "fcntl.h"
+#include "sys/stat.h"
+}
+
+namespace watch_impl
+{
+    // Runs fn(0) .. fn(count - 1) on up to threads threads, inline when one is enough.
+    template<typename Fn>
+    void parallel_for(size_t count, unsigned threads, Fn&& fn)
+    {
+        size_t workers = std::min<size_t>(threads, count);
+        if(workers <= 1)
+        {
+            for(size_t i = 0; i < count; i++)
+                fn(i);
+            return;
+        }
+
+        std::atomic<size_t> next{0};
+        std::vector<std::thread> pool;
+        for(size_t w = 0; w < workers; w++)
+        {
+            pool.emplace_back([&]
+            {
+                for(size_t i = next++; i < count; i = next++)
+                    fn(i);
+            });
+        }
+        for(auto& thread : pool)
+            thread.join();
+    }
+}
+
+namespace watch
+{
+    // What a tree or a snapshot remembers about each entry.
+    struct file_info
+    {
+        uint64_t Size = 0;
+        int64_t ModifiedNs = 0;
+        uint64_t Inode = 0;
+    };
+}
+
+namespace watch_impl
+{
+    // Stats one entry without following symlinks, returns false if it no longer exists.
+    inline bool stat_entry(int dirFd, const char* path, watch::file_info& info, bool& isDirectory)
+    {
+#ifdef STATX_SIZE
+        struct statx result;
+        unsigned mask = STATX_TYPE | STATX_SIZE | STATX_INO | STATX_MTIME;
+        if(statx(dirFd, path, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC, mask, &result) != 0)
+            return false;
+        isDirectory = S_ISDIR(result.stx_mode);
+        info.Size = result.stx_size;
+        info.ModifiedNs = static_cast<int64_t>(result.stx_mtime.tv_sec) * 1000000000 + result.stx_mtime.tv_nsec;
+        info.Inode = result.stx_ino;
+#else
+        struct stat result;
+        if(fstatat(dirFd, path, &result, AT_SYMLINK_NOFOLLOW) != 0)
+            return false;
+        isDirectory = S_ISDIR(result.st_mode);
+        info.Size = static_cast<uint64_t>(result.st_size);
+        info.ModifiedNs = static_cast<int64_t>(result.st_mtim.tv_sec) * 1000000000 + result.st_mtim.tv_nsec;
+        info.Inode = static_cast<uint64_t>(result.st_ino);
+#endif
+        return true;
+    }
+}
+
+namespace watch
+{
+    // The entries of one directory at one point in time, sorted by name. Names and the fixed
+    // size per-entry fields are kept in separate arrays, so comparing two entries with the same
+    // name is a single memcmp over the fields.
+    class directory_snapshot
+    {
+        std::vector<std::string> names_;
+        std::vector<file_info> info_;
+        std::vector<bool> directories_;
+        bool sorted_ = true;
+
+    public:
+        // Lists path without following symlinks. Returns an empty snapshot and sets error to
+        // errno when the directory cannot be opened.
+        static directory_snapshot Capture(const std::string& path, int* error = nullptr)
+        {
+            if(error != nullptr)
+                *error = 0;
+
+            directory_snapshot result;
+            DIR* dir = opendir(path.c_str());
+            if(dir == nullptr)
+            {
+                if(error != nullptr)
+                    *error = errno;
+                return result;
+            }
+
+            int fd = dirfd(dir);
+            while(dirent* entry = readdir(dir))
+            {
+                if(std::strcmp(entry->d_name, ".") == 0 || std::strcmp(entry->d_name, "..") == 0)
+                    continue;
+
+                file_info info;
+                bool isDirectory = false;
+                if(watch_impl::stat_entry(fd, entry->d_name, info, isDirectory))
+                    result.Add(entry->d_name, info, isDirectory);
+            }
+            closedir(dir);
+            result.Sort();
+            return result;
+        }
+
+        // Adds an entry, Sort must be called before the snapshot is diffed.
+        void Add(std::string name, const file_info& info, bool isDirectory = false)
+        {
+            if(!names_.empty() && name < names_.back())
+                sorted_ = false;
+            names_.push_back(std::move(name));
+            info_.push_back(info);
+            directories_.push_back(isDirectory);
+        }
+
+        void Sort()
+        {
+            if(sorted_)
+                return;
+
+            std::vector<uint32_t> order(names_.size());
+            for(uint32_t i = 0; i < order.size(); i++)
+                order[i] = i;
+            std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b){ return names_[a] < names_[b]; });
+
+            std::vector<std::string> names;
+            std::vector<file_info> info;
+            std::vector<bool> directories;
+            names.reserve(order.size());
+            info.reserve(order.size());
+            directories.reserve(order.size());
+            for(uint32_t i : order)
+            {
+                names.push_back(std::move(names_[i]));
+                info.push_back(info_[i]);
+                directories.push_back(directories_[i]);
+            }
+            names_.swap(names);
+            info_.swap(info);
+            directories_.swap(directories);
+            sorted_ = true;
+        }
+
+        size_t Size() const { return names_.size(); }
+        const std::string& Name(size_t i) const { return names_[i]; }
+        const file_info& Info(size_t i) const { return info_[i]; }
+        bool IsDirectory(size_t i) const { return directories_[i]; }
+
+        // Position of the first entry not less than name.
+        size_t LowerBound(std::string_view name) const
+        {
+            return std::lower_bound(names_.begin(), names_.end(), name,
+                                    [](const std::string& a, std::string_view b){ return a < b; }) - names_.begin();
+        }
+    };
+}
+
+namespace watch_impl
+{
+    // Merges before[i, endBefore) with after[j, endAfter), both sorted.
+    inline void diff_range(const watch::directory_snapshot& before, size_t i, size_t endBefore,
+                           const watch::directory_snapshot& after, size_t j, size_t endAfter,
+                           std::vector<watch::directory_event>& out)
+    {
+        using watch::directory_event;
+        while(i < endBefore || j < endAfter)
+        {
+            int order = i == endBefore ? 1 : j == endAfter ? -1 : before.Name(i).compare(after.Name(j));
+            if(order < 0)
+            {
+                out.emplace_back(directory_event::file_deleted, before.Name(i++));
+                continue;
+            }
+            if(order > 0)
+            {
+                out.emplace_back(directory_event::file_created, after.Name(j++));
+                continue;
+            }
+
+            const watch::file_info& old = before.Info(i);
+            const watch::file_info& now = after.Info(j);
+            if(std::memcmp(&old, &now, sizeof(watch::file_info)) != 0)
+            {
+                auto type = old.Inode != now.Inode ? directory_event::file_replaced : directory_event::file_modified;
+                out.emplace_back(type, after.Name(j));
+            }
+            i++;
+            j++;
+        }
+    }
+}
+
+namespace watch
+{
+    // Events that turn before into after, in name order: file_created and file_deleted for
+    // names only on one side, file_replaced when the inode changed and file_modified when only
+    // size or modification time did. Large snapshots are cut into name ranges diffed in parallel.
+    inline std::vector<directory_event> Diff(const directory_snapshot& before, const directory_snapshot& after,
+                                             unsigned threads = std::thread::hardware_concurrency())
+    {
+        constexpr size_t MinRangeEntries = 64 * 1024; // below this a thread costs more than it saves
+
+        std::vector<directory_event> result;
+        size_t total = before.Size() + after.Size();
+        size_t ranges = std::min<size_t>(threads == 0 ? 1 : threads, total / MinRangeEntries);
+        if(ranges <= 1 || before.Size() == 0)
+        {
+            watch_impl::diff_range(before, 0, before.Size(), after, 0, after.Size(), result);
+            return result;
+        }
+
+        // cut at evenly spaced names of before, the same name splits after
+        std::vector<size_t> cutBefore{0}, cutAfter{0};
+        for(size_t r = 1; r < ranges; r++)
+        {
+            size_t i = before.Size() * r / ranges;
+            if(i <= cutBefore.back())
+                continue;
+            cutBefore.push_back(i);
+            cutAfter.push_back(after.LowerBound(before.Name(i)));
+        }
+        cutBefore.push_back(before.Size());
+        cutAfter.push_back(after.Size());
+
+        std::vector<std::vector<directory_event>> parts(cutBefore.size() - 1);
+        watch_impl::parallel_for(parts.size(), threads, [&](size_t r)
+        {
+            watch_impl::diff_range(before, cutBefore[r], cutBefore[r + 1], after, cutAfter[r], cutAfter[r + 1], parts[r]);
+        });
+
+        size_t count = 0;
+        for(auto& part : parts)
+            count += part.size();
+        result.reserve(count);
+        for(auto& part : parts)
+            std::move(part.begin(), part.end(), std::back_inserter(result));
+        return result;
+    }
+
+    // Diffs many directories at once, one directory per task. Entry k of the result belongs to
+    // pairs[k].
+    inline std::vector<std::vector<directory_event>> Diff(
+        const std::vector<std::pair<const directory_snapshot*, const directory_snapshot*>>& pairs,
+        unsigned threads = std::thread::hardware_concurrency())
+    {
+        std::vector<std::vector<directory_event>> result(pairs.size());
+        watch_impl::parallel_for(pairs.size(), threads == 0 ? 1 : threads, [&](size_t k)
+        {
+            watch_impl::diff_range(*pairs[k].first, 0, pairs[k].first->Size(),
+                                   *pairs[k].second, 0, pairs[k].second->Size(), result[k]);
+        });
+        return result;
+    }
+}
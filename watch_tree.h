@@ -0,0 +1,345 @@
+#pragma once
+
+#include "watch.h"
+#include "watch_snapshot.h"
+
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace watch
+{
+    struct tree_usage
+    {
+        uint64_t Bytes = 0;       // apparent size of all files
+        uint64_t Files = 0;       // non-directory entries, symlinks included
+        uint64_t Directories = 0; // subdirectories, the directory itself not included
+    };
+
+    // Watches a directory tree recursively, one inotify watch per directory, and keeps the size
+    // and file count of every subtree current. The tree is seeded with one scan that lists the
+    // directories of each level in parallel; afterwards only names reported by events are
+    // stat'ed again, and each change is added to the totals of its directory and its ancestors,
+    // so Usage of any subtree is a single lookup. The tree owns its pool and is not thread safe.
+    class tree_watch
+    {
+    protected:
+        struct node
+        {
+            node* Parent;
+            std::string Path; // without trailing slash
+            std::string Name; // entry name in the parent
+            std::unique_ptr<directory> Watch;
+            std::unordered_map<std::string, file_info> Files;
+            std::unordered_map<std::string, std::unique_ptr<node>> Children;
+            tree_usage Total;
+        };
+
+        global_watch_pool_type pool_;
+        unsigned threads_;
+        std::unique_ptr<node> root_;
+        std::unordered_map<std::string, node*> byPath_;
+        std::unordered_map<global_watch_pool_type::id_type, node*> byHandle_;
+        std::vector<global_watch_pool_type::id_type> dirty_;
+
+        static std::string Trim(std::string path)
+        {
+            while(path.size() > 1 && path.back() == '/')
+                path.pop_back();
+            return path;
+        }
+
+        template<typename Fn>
+        void ParallelFor(size_t count, Fn&& fn)
+        {
+            watch_impl::parallel_for(count, threads_, std::forward<Fn>(fn));
+        }
+
+        // Adds a change to a directory and all of its ancestors.
+        void Adjust(node* target, int64_t bytes, int64_t files, int64_t directories)
+        {
+            for(node* current = target; current != nullptr; current = current->Parent)
+            {
+                current->Total.Bytes += bytes;
+                current->Total.Files += files;
+                current->Total.Directories += directories;
+            }
+        }
+
+        // Hooks for trees that keep more per-file state, called after the totals were updated.
+        virtual void OnFileChanged(node*, const std::string&, const file_info*, const file_info*) {}
+        virtual void OnChildChanged(node*, node*, bool /*added*/) {}
+
+        void SetFile(node* parent, const std::string& name, const file_info& info)
+        {
+            auto inserted = parent->Files.emplace(name, info);
+            if(inserted.second)
+            {
+                Adjust(parent, (int64_t)info.Size, 1, 0);
+                OnFileChanged(parent, name, nullptr, &inserted.first->second);
+                return;
+            }
+
+            file_info old = inserted.first->second;
+            inserted.first->second = info;
+            Adjust(parent, (int64_t)info.Size - (int64_t)old.Size, 0, 0);
+            OnFileChanged(parent, name, &old, &inserted.first->second);
+        }
+
+        void RemoveFile(node* parent, const std::string& name)
+        {
+            auto iter = parent->Files.find(name);
+            if(iter == parent->Files.end())
+                return;
+            file_info old = iter->second;
+            parent->Files.erase(iter);
+            Adjust(parent, -(int64_t)old.Size, -1, 0);
+            OnFileChanged(parent, name, &old, nullptr);
+        }
+
+        // The child's watch is created here, before its contents are listed, so nothing that
+        // changes during the scan is missed.
+        node* AddChild(node* parent, const std::string& name)
+        {
+            auto iter = parent->Children.find(name);
+            if(iter != parent->Children.end())
+                return iter->second.get();
+
+            std::unique_ptr<node> child(new node());
+            child->Parent = parent;
+            child->Name = name;
+            child->Path = (parent->Path == "/" ? "/" : parent->Path + "/") + name;
+            child->Watch.reset(new directory(child->Path, &pool_));
+
+            node* result = child.get();
+            Register(result);
+            parent->Children.emplace(name, std::move(child));
+            Adjust(parent, 0, 0, 1);
+            OnChildChanged(parent, result, true);
+            return result;
+        }
+
+        void Register(node* target)
+        {
+            byPath_[target->Path] = target;
+            if(!target->Watch->Dead)
+                byHandle_[target->Watch->NativeHandle] = target;
+        }
+
+        void Unregister(node* target)
+        {
+            for(auto& child : target->Children)
+                Unregister(child.second.get());
+            // a directory moved within the tree keeps its inotify watch, so the handle may already
+            // belong to the node at its new place
+            auto path = byPath_.find(target->Path);
+            if(path != byPath_.end() && path->second == target)
+                byPath_.erase(path);
+            if(!target->Watch->Dead)
+            {
+                auto handle = byHandle_.find(target->Watch->NativeHandle);
+                if(handle != byHandle_.end() && handle->second == target)
+                    byHandle_.erase(handle);
+            }
+        }
+
+        void RemoveChild(node* parent, const std::string& name)
+        {
+            auto iter = parent->Children.find(name);
+            if(iter == parent->Children.end())
+                return;
+
+            node* child = iter->second.get();
+            Unregister(child);
+            Adjust(parent, -(int64_t)child->Total.Bytes, -(int64_t)child->Total.Files,
+                   -(int64_t)child->Total.Directories - 1);
+            OnChildChanged(parent, child, false);
+            parent->Children.erase(iter);
+        }
+
+        void Clear(node* target)
+        {
+            while(!target->Children.empty())
+                RemoveChild(target, target->Children.begin()->first);
+            while(!target->Files.empty())
+                RemoveFile(target, target->Files.begin()->first);
+        }
+
+        // Scans the subtree below start one level at a time, the directories of a level are listed in parallel.
+        void Populate(node* start)
+        {
+            std::vector<node*> level{start};
+            while(!level.empty())
+            {
+                std::vector<directory_snapshot> listings(level.size());
+                ParallelFor(level.size(), [&](size_t i)
+                {
+                    listings[i] = directory_snapshot::Capture(level[i]->Path);
+                });
+
+                std::vector<node*> next;
+                for(size_t i = 0; i < level.size(); i++)
+                {
+                    const directory_snapshot& listing = listings[i];
+                    for(size_t j = 0; j < listing.Size(); j++)
+                    {
+                        if(listing.IsDirectory(j))
+                            next.push_back(AddChild(level[i], listing.Name(j)));
+                        else
+                            SetFile(level[i], listing.Name(j), listing.Info(j));
+                    }
+                }
+                level.swap(next);
+            }
+        }
+
+        // Brings one name in a directory up to date, whatever the event was.
+        void Apply(node* parent, const std::string& name)
+        {
+            file_info info;
+            bool isDirectory = false;
+            std::string path = (parent->Path == "/" ? "/" : parent->Path + "/") + name;
+            if(!watch_impl::stat_entry(AT_FDCWD, path.c_str(), info, isDirectory))
+            {
+                RemoveFile(parent, name);
+                RemoveChild(parent, name);
+            }
+            else if(isDirectory)
+            {
+                RemoveFile(parent, name);
+                if(parent->Children.find(name) == parent->Children.end())
+                    Populate(AddChild(parent, name));
+            }
+            else
+            {
+                RemoveChild(parent, name);
+                SetFile(parent, name, info);
+            }
+        }
+
+        // What the tree knows about a directory, as a snapshot to diff against the disk.
+        // Subdirectories carry no fields, so they always differ and are looked at again.
+        static directory_snapshot Known(const node* target)
+        {
+            directory_snapshot known;
+            for(auto& file : target->Files)
+                known.Add(file.first, file.second);
+            for(auto& child : target->Children)
+                known.Add(child.first, file_info(), true);
+            known.Sort();
+            return known;
+        }
+
+        // Reconciles a directory whose events were lost by diffing what the tree knows against a
+        // fresh listing, and everything below it when the scope is a subtree.
+        void Rescan(node* target, rescan_scope scope)
+        {
+            std::vector<std::string> children;
+            if(scope == rescan_scope::subtree)
+            {
+                for(auto& child : target->Children)
+                    children.push_back(child.first);
+            }
+
+            for(auto& change : Diff(Known(target), directory_snapshot::Capture(target->Path), threads_))
+                Apply(target, std::string(change.Name));
+
+            // directories added by Apply were just populated, only the ones kept need a look
+            for(auto& name : children)
+            {
+                auto iter = target->Children.find(name);
+                if(iter != target->Children.end())
+                    Rescan(iter->second.get(), scope);
+            }
+        }
+
+        // Returns false once target was removed from the tree.
+        bool Drain(node* target)
+        {
+            directory& watch = *target->Watch;
+            directory_event event;
+            while(pool_.Poll(watch.NativeHandle, watch.Ticket, event))
+            {
+                if(event.Type == directory_event::watch_directory_destroyed)
+                {
+                    if(target->Parent != nullptr)
+                    {
+                        RemoveChild(target->Parent, target->Name);
+                        return false;
+                    }
+                    byHandle_.erase(watch.NativeHandle);
+                    watch.Dead = true;
+                    Clear(target);
+                    return false;
+                }
+                if(event.Type == directory_event::events_overflowed)
+                    Rescan(target, event.Scope);
+                else
+                    Apply(target, event.Name);
+            }
+            return true;
+        }
+
+    public:
+        explicit tree_watch(const std::string& root, unsigned threads = std::thread::hardware_concurrency()) :
+            pool_(),
+            threads_(threads == 0 ? 1 : threads),
+            root_(new node())
+        {
+            root_->Parent = nullptr;
+            root_->Path = Trim(root);
+            root_->Watch.reset(new directory(root_->Path, &pool_));
+            Register(root_.get());
+            Populate(root_.get());
+        }
+
+        tree_watch(const tree_watch&) = delete;
+        tree_watch& operator=(const tree_watch&) = delete;
+
+        virtual ~tree_watch() = default;
+
+        // Applies every pending change.
+        void Refresh()
+        {
+            // a lost root comes back once its directory exists again, with a subtree marker
+            // like any other watch
+            if(root_->Watch->Dead)
+            {
+                directory_event marker;
+                if(!root_->Watch->Revive(marker))
+                    return;
+                Register(root_.get());
+                Rescan(root_.get(), marker.Scope);
+            }
+
+            pool_.Drain();
+
+            dirty_.clear();
+            pool_.TakeDirty(dirty_);
+            for(auto handle : dirty_)
+            {
+                auto iter = byHandle_.find(handle);
+                if(iter != byHandle_.end())
+                    Drain(iter->second);
+            }
+        }
+
+        // Totals of the subtree at path, zero for paths outside the tree.
+        tree_usage Usage(const std::string& path) const
+        {
+            auto iter = byPath_.find(Trim(path));
+            return iter == byPath_.end() ? tree_usage() : iter->second->Total;
+        }
+
+        tree_usage Usage() const
+        {
+            return root_->Total;
+        }
+
+        // Number of directories watched, the root included.
+        size_t Watches() const
+        {
+            return byPath_.size();
+        }
+    };
+}